@@ -0,0 +1,68 @@
+#ifndef _UTHREAD_ALLOCATOR_H
+#define _UTHREAD_ALLOCATOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+/**
+ * @brief Allocates size bytes, like malloc, in a way that is safe under preemption by the thread library.
+ *
+ * Small blocks come from a cache of the calling thread without masking the timer signal.
+ *
+ * @return On success, return a pointer to the allocated memory. On failure, return nullptr.
+*/
+void *uthread_malloc(size_t size);
+
+/**
+ * @brief Frees a block returned by uthread_malloc, like free. Freeing nullptr has no effect.
+*/
+void uthread_free(void *ptr);
+
+/**
+ * A standard library allocator on top of uthread_malloc, e.g. std::vector<int, uthread_allocator<int>>.
+ */
+template <class T>
+struct uthread_allocator
+{
+    typedef T value_type;
+
+    uthread_allocator() noexcept = default;
+
+    template <class U>
+    uthread_allocator(const uthread_allocator<U> &) noexcept
+    {}
+
+    T *allocate(size_t n)
+    {
+        if (n > SIZE_MAX / sizeof(T))
+        {
+            throw std::bad_array_new_length();
+        }
+        void *ptr = uthread_malloc(n * sizeof(T));
+        if (ptr == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        return static_cast<T *>(ptr);
+    }
+
+    void deallocate(T *ptr, size_t) noexcept
+    {
+        uthread_free(ptr);
+    }
+};
+
+template <class T, class U>
+bool operator==(const uthread_allocator<T> &, const uthread_allocator<U> &) noexcept
+{
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const uthread_allocator<T> &, const uthread_allocator<U> &) noexcept
+{
+    return false;
+}
+
+#endif
@@ -1,4 +1,7 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
 #include <vector>
 #include <set>
 #include <armadillo>
@@ -7,17 +10,30 @@
 #include <signal.h>
 #include <ctime>
 #include <cstdlib>
+#include <climits>
 #include <csetjmp>
 #include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
 #include <map>
 #include <queue>
 #include "uthreads.h"
+#include "uthreads_stats.h"
+#include "uthreads_ext.h"
+#include "uthreads_core.h"
 #include <algorithm>
 
 
 /**Macros**/
-#define JB_SP 6
-#define JB_PC 7
 #define INIT_ERROR "thread library error: quantum_usecs parameter need to be positive"
 #define SLEEP_ERROR "thread library error: sleep of main thread"
 #define TERMINATION_ERROR_1 "thread library error: termination of main thread"
@@ -31,57 +47,352 @@
 #define RESUME_ERROR "system error: tried to resume an nonexistent thread"
 #define GET_QUANTUM_ERROR "system error: tried to get the num quantum of an nonexistent thread"
 #define EMPTY_SET_ERROR "system error: sigemptyset call failed"
+#define IO_HELPER_ERROR "system error: failed to create an io helper thread"
+#define IO_HELPER_THREADS 4
+#define STACK_USAGE_ERROR "thread library error: tried to get the stack usage of a thread without a profiled stack"
+#define STACK_CANARY 0xCD
+#define SAVED_STACK_ERROR "thread library error: tried to get the saved stack size of an nonexistent thread"
+#define GROUP_ERROR_1 "thread library error: group quota and period need to be positive"
+#define GROUP_ERROR_2 "thread library error: tried to use an nonexistent group"
+#define NO_GROUP (-1)
+#define SHARED_STACK_SIZE (64 * scheduler::stack_size)
+#define RED_ZONE_SIZE 128 // bytes below the stack pointer a function may still use on x86-64
+#define STATS_PAGE_ERROR "system error: failed to create the stats page"
+#define ARENA_ERROR "system error: failed to map memory for the allocator arena"
+#define STACK_ERROR "system error: failed to map a thread stack"
+#define ALLOC_CLASSES 8 // blocks of 32, 64, ..., 4096 bytes, header included
+#define ALLOC_MIN_BLOCK 32
+#define ALLOC_HEADER_SIZE 16 // keeps the payload 16 bytes aligned, like malloc
+#define ALLOC_LARGE ALLOC_CLASSES // size class of blocks too big for the arena, taken from malloc
+#define ALLOC_REFILL_BLOCKS 32 // blocks moved from the arena to a thread cache at once
+#define ALLOC_CACHE_LIMIT 128 // a thread cache above this returns half of its blocks to the arena
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define SAVE_BUFFER_PAGE 4096 // save buffers above the largest arena block are mapped in whole pages
+#define SAVE_BUFFER_SHRINK 4 // a save buffer this many times larger than the live stack is replaced by a smaller one
+#define PROFILER_ERROR_1 "thread library error: profiler interval_usecs parameter need to be positive"
+#define PROFILER_ERROR_2 "thread library error: failed to open the profile output file"
+#define PROFILER_MAX_SAMPLES 16384
+#define PROFILER_MAX_DEPTH 32
+#define TIMER_BACKEND_ERROR "thread library error: unknown timer backend"
+#define RUN_ONCE_ERROR_1 "thread library error: uthread_run_once needs TIMER_BACKEND_NONE and the main thread"
+#define RUN_ONCE_ERROR_2 "thread library error: uthread_run_once budget_usecs parameter need to be non-negative"
 #define FAILURE (-1)
 #define SUCCESS 0
 
 
 /**Data Structures and Globals**/
-typedef unsigned long address_t;
 typedef void (*thread_entry_point)(void);
 using namespace std;
 
-enum thread_state {
-    READY,
-    BLOCKED,
-    RUNNING
-};
-
+// Hot part of a thread control block - the fields the scheduler reads on every decision and scan.
+// Packed four to a cache line, so a scan over every thread touches a quarter of the lines padding would
+// (see uthreads_bench_layout). Only one kernel thread runs the uthreads, so there is no false sharing to avoid.
 typedef struct{
     int id;
     thread_state state;
     int num_of_quantum;
+    int group; // NO_GROUP for threads outside any group
+}thread;
+
+enum io_operation {
+    IO_READ,
+    IO_WRITE,
+    IO_FSYNC
+};
+
+// A file operation of a parked thread, as handed to the helper thread pool.
+typedef struct{
+    int tid;
+    unsigned ticket;
+    io_operation op;
+    int fd;
+    struct iovec vec;
+    off_t offset;
+    ssize_t result;
+}io_request;
+
+// A set of threads sharing a cpu bandwidth quota of quota quanta in every period of period quanta.
+typedef struct{
+    int quota;
+    int period;
+    int period_start; // total_quantum when the current period began
+    int used; // quanta started in the current period
+    int consumed; // quanta started since the group was created
+    int throttled_quanta; // quanta spent throttled in the periods that already ended
+    int throttled_since; // first quantum the group sat out after running out of its quota, -1 if not throttled
+}thread_group;
+
+// A free block of the allocator, the link lives in the payload.
+typedef struct free_block{
+    struct free_block *next;
+}free_block;
+
+// Start of every block handed out by uthread_malloc.
+typedef struct{
+    size_t size_class;
+    size_t padding;
+}alloc_header;
+
+// One SIGPROF sample, frames[0] is the interrupted instruction and the rest are return addresses.
+typedef struct{
+    int tid;
+    thread_entry_point entry_point;
+    int depth;
+    address_t frames[PROFILER_MAX_DEPTH];
+}profile_sample;
+
+// Cold part of a thread control block - only touched on spawn, context switch and termination.
+typedef struct{
     char *stack;
     void (*thread_func) ();
     sigjmp_buf env;
-}thread;
+    struct iovec io_vec; // must stay alive until the kernel consumed the submission
+    unsigned io_ticket; // tells a completion of the current request from one of an earlier owner of the tid
+    bool io_pending;
+    bool io_orphaned; // terminated while io_pending, the stack and the tid are released on completion
+    ssize_t io_result; // bytes transferred or -errno
+    char *io_bounce; // stands in for a buffer on the shared stack while the request is in flight
+    size_t io_bounce_capacity;
+    bool stack_profiled; // the stack was filled with STACK_CANARY on spawn
+    bool on_shared_stack; // runs on shared_stack instead of a private stack
+    char *saved_stack; // live part of the shared stack, while another thread owns it
+    size_t saved_size;
+    size_t saved_capacity;
+    free_block *alloc_cache[ALLOC_CLASSES]; // touched only by the thread itself, so it needs no masking
+    int alloc_cached[ALLOC_CLASSES];
+}thread_context;
+
+// The shared io_uring, mapped from the kernel. We are its only producer and only consumer.
+typedef struct{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit; // queued in the ring since the last io_uring_enter
+}io_ring;
+
+// Requests in a fixed ring - never allocates, so it is safe to use from the timer signal handler. A thread id has
+// at most one request in flight (a terminated thread keeps its id until the completion), so MAX_THREAD_NUM fit.
+typedef struct{
+    io_request requests[MAX_THREAD_NUM];
+    int head;
+    int count;
+}io_queue;
 
+// Fallback for kernels without io_uring - helper kernel threads running the blocking calls.
+typedef struct{
+    pthread_mutex_t lock;
+    pthread_cond_t has_jobs;
+    pthread_cond_t has_done;
+    io_queue jobs; // shared with the helpers, guarded by lock
+    io_queue done; // shared with the helpers, guarded by lock
+    io_queue unsubmitted; // owned by the scheduler, handed over on flush
+}io_pool;
+
+// Masking of the C API - the timer signal, unless the library runs without signals (TIMER_BACKEND_NONE).
+// The backend is picked at run time, so this is the one place the C API checks it on every masking.
+struct uthreads_masking{
+    static constexpr bool preemptive = true;
+    static int mask(bool to_mask);
+};
+
+struct uthreads_config;
+typedef basic_scheduler<uthreads_config> scheduler;
+
+// What the C API adds to the scheduling decisions of the core - io, thread groups, uthread_run_once, the timer,
+// shared and profiled stacks and the stats page.
+struct uthreads_hooks : default_hooks{
+    static void before_decision(scheduler &);
+    static void idle(scheduler &);
+    static int forced_pick(scheduler &);
+    static bool eligible(scheduler &, int tid);
+    static int fallback_pick(scheduler &);
+    static void restart_quantum(scheduler &);
+    static void dispatched(scheduler &);
+    static address_t prepare_stack(scheduler &, int tid);
+    static bool release_thread(scheduler &, int tid);
+    static void before_jump(scheduler &, int tid);
+};
+
+// The scheduler core behind the C API, see uthreads_core.h.
+struct uthreads_config{
+    typedef thread thread_type;
+    typedef thread_context context_type;
+    typedef round_robin_policy policy;
+    typedef uthreads_masking masking;
+    typedef uthreads_hooks hooks;
+    static constexpr int capacity = MAX_THREAD_NUM;
+    static constexpr int stack_size = STACK_SIZE;
+    static constexpr bool report_errors = true;
+    static constexpr bool tracing = false;
+};
 
 
-std::vector<int> *free_ids;
-std::vector <int> *taken_ids;
-std::map<int, thread*> *thread_map;
-std::multimap<int,int> *sleep_map;
-std::deque<int> *ready_queue;
+scheduler core;
+thread *threads = core.threads; // hot blocks, indexed by thread id
+thread_context *thread_contexts = core.contexts; // cold blocks, indexed by thread id
+thread *&running_thread = core.running;
+int &total_quantum = core.total_quantum;
 sigset_t maskSignals{};
 //queue<int> ready_queue;
 int gotit = 0;
-int total_quantum;
 struct itimerval timer;
+int timer_backend = TIMER_BACKEND_ITIMER;
+timer_t posix_timer_id;
+bool posix_timer_created = false;
+struct itimerspec posix_timer; // relative deadline, re-armed on every set_timer
+int quantum_length; // in micro-seconds
+bool hosting = false; // the main thread is inside uthread_run_once
+struct timespec host_deadline; // when uthread_run_once has to return to the host
 struct sigaction sa;
-thread *running_thread;
+char *retired_stack = nullptr; // stack of a thread that terminated itself, unmapped once we run on another stack
 //sigjmp_buf env[MAX_THREAD_NUM];
+bool io_initialized = false;
+bool io_uring_available = false;
+int io_in_flight = 0;
+io_ring ring;
+io_pool pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, {}, {}, {}};
+bool stack_profiling = false;
+std::map<thread_entry_point, int> *stack_peaks; // highest stack usage seen per entry point
+std::vector<thread_group> *groups; // indexed by group id
+bool shared_stack_mode = false;
+char *shared_stack = nullptr;
+int shared_stack_owner = -1; // the thread whose frames are on the shared stack right now
+profile_sample *profile_samples = nullptr; // preallocated, the signal handler only fills it
+volatile int profile_count = 0;
+volatile int profile_dropped = 0;
+address_t main_stack_low;
+address_t main_stack_high;
+char *switch_stack = nullptr; // runs the copy into the shared stack, so the copy never overwrites itself
+sigjmp_buf switch_env;
+thread *switch_target;
+long stack_copies = 0;
+long stack_copy_bytes = 0;
+uthreads_stats_page *stats_page = nullptr;
+free_block *arena_free[ALLOC_CLASSES]; // shared by all the threads, touched only with signals masked
+free_block *arena_chunks = nullptr; // every chunk mapped for the arena, linked through its first block
+char stats_page_name[32];
+
+void release_thread_resources(int tid);
+char *get_save_buffer(size_t size, size_t *capacity);
+void put_save_buffer(char *buffer, size_t capacity);
+
+/**
+ * Returns the cold part (stack and saved context) of a given thread
+ * @param cur_thread the given thread
+ * @return the thread context
+ */
+thread_context *get_context(thread *cur_thread)
+{
+    return &thread_contexts[cur_thread->id];
+}
+
+/**
+ * Measures the stack high water mark of a given thread by looking for the deepest overwritten canary byte.
+ * The stack grows down, so the scan starts at the lowest address.
+ * @param cur_thread the given thread, must have a profiled stack
+ * @return the number of stack bytes the thread has used so far
+ */
+int measure_stack_usage(thread *cur_thread)
+{
+    const char *stack = get_context(cur_thread)->stack;
+    int untouched = 0;
+    while (untouched < scheduler::stack_size && (unsigned char) stack[untouched] == STACK_CANARY)
+    {
+        untouched++;
+    }
+    return scheduler::stack_size - untouched;
+}
+
+/**
+ * Adds the stack usage of a given thread to the peak of its entry point
+ * @param cur_thread the given thread
+ */
+void record_stack_peak(thread *cur_thread)
+{
+    thread_context *context = get_context(cur_thread);
+    if (!context->stack_profiled || context->stack == nullptr)
+    {
+        return;
+    }
+    int &peak = stack_peaks->at(context->thread_func); // created on spawn, never allocates here
+    peak = std::max(peak, measure_stack_usage(cur_thread));
+}
+
+/**
+ * Prints the peak stack usage of every entry point that ran with a profiled stack
+ */
+void dump_stack_usage()
+{
+    for (int tid = 1; tid < scheduler::capacity; tid++)
+    {
+        if (core.exists(tid))
+        {
+            record_stack_peak(&threads[tid]);
+        }
+    }
+    std::cerr << "stack usage (peak bytes of " << scheduler::stack_size << ") per entry point:" << std::endl;
+    for (auto &itr : *stack_peaks)
+    {
+        Dl_info info;
+        if (dladdr((void *) itr.first, &info) && info.dli_sname != nullptr)
+        {
+            std::cerr << "  " << info.dli_sname;
+        }
+        else
+        {
+            std::cerr << "  " << (void *) itr.first;
+        }
+        std::cerr << ": " << itr.second << std::endl;
+    }
+}
 
-void add_thread_to_ready_queue(int  cur_thread);
+/**
+ * Unmaps the stack of the last thread that terminated itself. Called only while running on another stack.
+ */
+void release_retired_stack()
+{
+    if (retired_stack != nullptr)
+    {
+        munmap(retired_stack, scheduler::stack_size);
+        retired_stack = nullptr;
+    }
+}
 
 /**
- * Frees the stack memory of a given thread
+ * Frees the stack memory of a given thread. Safe in the timer signal handler, where a completion of a thread
+ * terminated during io releases its stack.
  * @param curr_thread_to_free given thread to the thread stack
  */
 void free_thread_stack(thread * curr_thread_to_free)
 {
-    // free(curr_thread_to_free->stack);
-    delete [] curr_thread_to_free->stack;
-    curr_thread_to_free->stack = nullptr;
+    thread_context *context = get_context(curr_thread_to_free);
+    record_stack_peak(curr_thread_to_free);
+    if (curr_thread_to_free == running_thread)
+    {
+        retired_stack = context->stack; // we are still running on it
+    }
+    else if (context->stack != nullptr)
+    {
+        munmap(context->stack, scheduler::stack_size);
+    }
+    context->stack = nullptr;
+    if (context->saved_stack != nullptr)
+    {
+        put_save_buffer(context->saved_stack, context->saved_capacity);
+    }
+    context->saved_stack = nullptr;
+    context->saved_size = context->saved_capacity = 0;
+    if (shared_stack_owner == curr_thread_to_free->id)
+    {
+        shared_stack_owner = -1;
+    }
 }
 
 /**
@@ -89,19 +400,37 @@ void free_thread_stack(thread * curr_thread_to_free)
  */
 void clean_memory()
 {
-    // frees all allocated stack for each thread in the map
-    for(auto it : *thread_map)
+    release_retired_stack();
+    // frees all allocated stack for each existing thread, and of the threads still waiting for their io
+    for (int tid = 0; tid < scheduler::capacity; tid++)
+    {
+        if (threads[tid].state != UNUSED)
+        {
+            free_thread_stack(&threads[tid]);
+        }
+    }
+    if (posix_timer_created)
+    {
+        timer_delete(posix_timer_id);
+        posix_timer_created = false;
+    }
+    delete [] shared_stack;
+    delete [] switch_stack;
+    delete [] profile_samples;
+    while (arena_chunks != nullptr)
+    {
+        free_block *chunk = arena_chunks;
+        arena_chunks = chunk->next;
+        munmap(chunk, ARENA_CHUNK_SIZE);
+    }
+    if (stats_page != nullptr)
     {
-        auto curr_thread = it.second;
-        free_thread_stack(curr_thread);
-        delete curr_thread;
-        curr_thread = nullptr;
+        munmap(stats_page, sizeof(uthreads_stats_page));
+        shm_unlink(stats_page_name);
+        stats_page = nullptr;
     }
-    delete ready_queue;
-    delete sleep_map;
-    delete thread_map;
-    delete free_ids;
-    delete taken_ids;
+    delete stack_peaks;
+    delete groups;
 }
 
 /**
@@ -109,26 +438,52 @@ void clean_memory()
  */
 void set_timer()
 {
-    auto ret = setitimer(ITIMER_VIRTUAL, &timer, NULL);
+    if (timer_backend == TIMER_BACKEND_NONE)
+    {
+        return;
+    }
+    int ret;
+    if (timer_backend == TIMER_BACKEND_ITIMER)
+    {
+        ret = setitimer(ITIMER_VIRTUAL, &timer, NULL);
+    }
+    else
+    {
+        ret = timer_settime(posix_timer_id, 0, &posix_timer, NULL);
+    }
     if (ret<0)
     {
-        std::cerr << TIMER_ERROR << std::endl;
+        core.report_error(TIMER_ERROR);
         clean_memory();
         exit(1);
     }
 }
 
 
+/**
+ * Masks or unmasks the timer signal for the scheduler core.
+ * @param to_mask True to mask False to unmask.
+ * @return sigprocmask return value
+ */
+int uthreads_masking::mask(bool to_mask)
+{
+    if (timer_backend == TIMER_BACKEND_NONE) // nothing can interrupt us
+    {
+        return SUCCESS;
+    }
+    int cur_action = to_mask ? SIG_BLOCK : SIG_UNBLOCK;
+    return sigprocmask(cur_action,&maskSignals, nullptr);
+}
+
 /**
  * This function masking or unmasking the signals.
  * @param to_mask True to mask False to unmask.
  */
 void mask_signals(bool to_mask){
-    int cur_action = to_mask ? SIG_BLOCK : SIG_UNBLOCK;
-    int ret = sigprocmask(cur_action,&maskSignals, nullptr);
+    int ret = core.mask_signals(to_mask);
     if(ret)
     {
-        std::cerr << SIGPROCMASK_ERROR << std::endl;
+        core.report_error(SIGPROCMASK_ERROR);
         clean_memory();
         exit(1);
     }
@@ -136,625 +491,1874 @@ void mask_signals(bool to_mask){
 }
 
 /**
- * Removes the given thread id from the ready queue
- * @param id The given id
+ * Copies the live part of the shared stack of a given thread - from its saved stack pointer to the top -
+ * into its private buffer. The buffer is replaced when the live part outgrows it, or is much smaller than it.
+ * @param cur_thread the given thread, the current owner of the shared stack
  */
-void remove_tid_from_ready_queue(int id)
+void save_shared_stack(thread *cur_thread)
 {
-    for (auto it = ready_queue->begin(); it != ready_queue->end(); ++it)
+    thread_context *context = get_context(cur_thread);
+    auto sp = (char *) demangle_address((context->env->__jmpbuf)[JB_SP]) - RED_ZONE_SIZE;
+    size_t size = shared_stack + SHARED_STACK_SIZE - sp;
+    if (size > context->saved_capacity || size * SAVE_BUFFER_SHRINK < context->saved_capacity)
     {
-        if(*it == id)
+        if (context->saved_stack != nullptr)
         {
-            ready_queue->erase(it);
-            return;
+            put_save_buffer(context->saved_stack, context->saved_capacity);
         }
+        context->saved_stack = get_save_buffer(size, &context->saved_capacity);
     }
+    memcpy(context->saved_stack, sp, size);
+    context->saved_size = size;
+    stack_copies++;
+    stack_copy_bytes += (long) size;
 }
 
 /**
- * Address translation to a given address
- * @param addr the given address
- * @return the translated address
+ * Runs on switch_stack: copies the saved frames of switch_target back into the shared stack and jumps to it.
  */
-address_t translate_address(address_t addr)
+void shared_stack_trampoline()
 {
-    address_t ret;
-    asm volatile("xor    %%fs:0x30,%0\n"
-                 "rol    $0x11,%0\n"
-                 : "=g" (ret)
-                 : "0" (addr));
-    return ret;
+    thread_context *context = get_context(switch_target);
+    if (context->saved_size > 0)
+    {
+        memcpy(shared_stack + SHARED_STACK_SIZE - context->saved_size, context->saved_stack, context->saved_size);
+        stack_copies++;
+        stack_copy_bytes += (long) context->saved_size;
+    }
+    siglongjmp(context->env,1);
 }
 
 /**
- * This function saves the given thread data
- * @param cur_thread the given thread
- * @return return value of sigsetjmp
+ * Jumps through the shared stack trampoline when a given thread runs on the shared stack and does not own it
+ * @param tid the given thread id
  */
-int set_thread_data(thread  *cur_thread)
+void uthreads_hooks::before_jump(scheduler &, int tid)
 {
-    return sigsetjmp(cur_thread->env,1);
+    thread_context *context = &thread_contexts[tid];
+    if (context->on_shared_stack && shared_stack_owner != tid)
+    {
+        if (shared_stack_owner != -1)
+        {
+            save_shared_stack(&threads[shared_stack_owner]);
+        }
+        shared_stack_owner = tid;
+        switch_target = &threads[tid];
+        siglongjmp(switch_env,1); // we may be running on the shared stack ourselves
+    }
 }
 
 /**
- * This function jumps to the given thread data
- * @param cur_thread the given thread
+ * Wrapper of the io_uring_setup system call
  */
-void jump_to_thread(thread * cur_thread)
+int io_uring_setup(unsigned entries, struct io_uring_params *params)
 {
-    siglongjmp(cur_thread->env,1);
+    return (int) syscall(__NR_io_uring_setup, entries, params);
 }
 
 /**
- * Sets the given set to empty
- * @param set the given set
- * @return sigemptyset return value
+ * Wrapper of the io_uring_enter system call
  */
-void set_empty_signal_set(sigset_t *set)
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
 {
-    if(sigemptyset(set))
-     {
-         std::cerr << EMPTY_SET_ERROR << std::endl;
-         clean_memory();
-         exit(1);
-     }
-}
-
-/**
- * This function resuming all the threads that should resume at this quantum.
- */
-void resuming_all_sleeping_threads(){
-    int cur_quantum = total_quantum;
-    for (auto & itr : *sleep_map)   // running on the current threads who should resume on this quantum
-        if (itr.first == cur_quantum)
-        {
-            uthread_resume(itr.second);
-        }
-    sleep_map->erase(total_quantum);
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
 }
 
 /**
- * This function takes the next thread from the ready queue and runs it.
- * it also calls the resuming function to wake up the sleeping threads.
+ * Creates the shared io_uring and maps its queues.
+ * @return true on success, false if io_uring is not usable on this system
  */
-void next_running_thread()
+bool setup_io_ring()
 {
-//    std::cout << "In next thread" << std::endl;
-    mask_signals(true);
-//    std::cout << "after mask" << std::endl;
-//    fflush(stdout);
-    static int cur_thread = 0;
-    //auto cur_thread_pointer = (*thread_map)[cur_thread];
-    if(set_thread_data(running_thread) == 1)
+    struct io_uring_params params{};
+    // A thread has at most one request in flight, so the ring never overflows
+    ring.fd = io_uring_setup(scheduler::capacity, &params);
+    if (ring.fd < 0)
     {
-        mask_signals(false);
-        return;
+        return false;
     }
-    cur_thread = ready_queue->back(); // access
-    ready_queue->pop_back(); // erase
-    total_quantum++;
-    resuming_all_sleeping_threads();
-    (*thread_map)[cur_thread]->state = RUNNING;
-    (*thread_map)[cur_thread]->num_of_quantum++;
-    if(running_thread->state == RUNNING)
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
     {
-        running_thread->state = READY;
-        add_thread_to_ready_queue(running_thread->id);
+        sq_size = cq_size = std::max(sq_size, cq_size);
     }
-    running_thread = (*thread_map)[cur_thread];
-//    std::cout << "before jump to next thread" << std::endl;
-//    fflush(stdout);
-    auto cur_thread_pointer = (*thread_map)[cur_thread];
-    jump_to_thread(cur_thread_pointer);
-//    std::cout << "after jump to next thread" << std::endl;
-//    fflush(stdout);
-    mask_signals(false);
+    auto sq = (char *) mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring.fd, IORING_OFF_SQ_RING);
+    auto cq = sq;
+    if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        cq = (char *) mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring.fd, IORING_OFF_CQ_RING);
+    }
+    auto sqes = mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        close(ring.fd);
+        return false;
+    }
+    ring.sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring.sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring.sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring.sqes = (struct io_uring_sqe *) sqes;
+    ring.cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring.cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring.cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring.to_submit = 0;
+    return true;
 }
 
 /**
- * This function handle the sigvt alarm sent by the timer.
- * Set a new thread in running.
- * @param sig the alarm index from
+ * Runs a single request on a helper thread
+ * @param request the given request, its result is filled in
  */
-void sigvtalrm_handler(int sig)
+void run_io_request(io_request *request)
 {
-    next_running_thread();
+    ssize_t ret = 0;
+    switch (request->op)
+    {
+        case IO_READ:
+            ret = pread(request->fd, request->vec.iov_base, request->vec.iov_len, request->offset);
+            break;
+        case IO_WRITE:
+            ret = pwrite(request->fd, request->vec.iov_base, request->vec.iov_len, request->offset);
+            break;
+        case IO_FSYNC:
+            ret = fsync(request->fd);
+            break;
+    }
+    request->result = ret < 0 ? -errno : ret;
 }
 
 /**
- * Setups a thread inside the env[] array.
- * @param tid thread tid
- * @param stack thread stack pointer
- * @param entry_point thread function
+ * Adds a request behind all the others in a given queue
+ * @param queue the given queue
+ * @param request the given request
  */
-void setup_thread(thread *thread)
+void push_io_request(io_queue *queue, const io_request &request)
 {
-    // initializes env[tid] to use the right stack, and to run from the function 'entry_point', when we'll use
-    // siglongjmp to jump into the thread.
-    address_t sp = (address_t) thread->stack + STACK_SIZE - sizeof(address_t);
-    address_t pc = (address_t) thread->thread_func;
-    set_thread_data(thread);
-//    std::cout << "before translate" << std::endl;
-//    fflush(stdout);
-    (thread->env->__jmpbuf)[JB_SP] = translate_address(sp);
-//    std::cout << "after translate 1" << std::endl;
-//    fflush(stdout);
-    (thread->env->__jmpbuf)[JB_PC] = translate_address(pc);
-//    std::cout << "after translate 2" << std::endl;
-//    fflush(stdout);
-    set_empty_signal_set(&thread->env->__saved_mask);
+    queue->requests[(queue->head + queue->count) % MAX_THREAD_NUM] = request;
+    queue->count++;
 }
 
 /**
- * Deleting a given id from the taken id vector.
- * @param index the given idex
+ * Removes and returns the oldest request of a given queue, which must not be empty
+ * @param queue the given queue
+ * @return the request
  */
-void delete_id_from_taken_id(int tid)
+io_request pop_io_request(io_queue *queue)
 {
-    taken_ids->erase(std::remove(taken_ids->begin(), taken_ids->end(), tid));
+    io_request request = queue->requests[queue->head];
+    queue->head = (queue->head + 1) % MAX_THREAD_NUM;
+    queue->count--;
+    return request;
 }
 
-
 /**
- * Deletes a given thread id by position index from the free_id vector
- * @param index the given index of the thread id
+ * Main loop of a helper thread of the fallback pool
  */
-void delete_id_from_free_id(int index)
+void *io_helper_main(void *)
 {
-    free_ids->erase(free_ids->begin()+index);
+    pthread_mutex_lock(&pool.lock);
+    while (true)
+    {
+        while (pool.jobs.count == 0)
+        {
+            pthread_cond_wait(&pool.has_jobs, &pool.lock);
+        }
+        io_request request = pop_io_request(&pool.jobs);
+        pthread_mutex_unlock(&pool.lock);
+        run_io_request(&request);
+        pthread_mutex_lock(&pool.lock);
+        push_io_request(&pool.done, request);
+        pthread_cond_signal(&pool.has_done);
+    }
+    return nullptr;
 }
 
 /**
- * Adds a given thread id by to the free_id vector
- * @param tid the given index of the thread id
+ * Starts the helper threads of the fallback pool. The helpers block every signal, so the
+ * timer signal is always delivered to the thread running the uthreads.
  */
-void add_id_to_free_id(int tid)
+void setup_io_pool()
 {
-    free_ids->push_back(tid);
+    sigset_t all_signals, old_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_mask);
+    for (int i = 0; i < IO_HELPER_THREADS; i++)
+    {
+        pthread_t helper;
+        if (pthread_create(&helper, nullptr, io_helper_main, nullptr))
+        {
+            core.report_error(IO_HELPER_ERROR);
+            clean_memory();
+            exit(1);
+        }
+        pthread_detach(helper);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
 }
 
 /**
- * Adding a given thread to the map<id,thread>
- * @param cur_thread the given thread
+ * Picks the io backend on the first file operation
  */
-void add_thread_to_map(thread* cur_thread){
-    (*thread_map)[cur_thread->id] = cur_thread;
+void init_io()
+{
+    if (io_initialized)
+    {
+        return;
+    }
+    io_uring_available = setup_io_ring();
+    if (!io_uring_available)
+    {
+        setup_io_pool();
+    }
+    io_initialized = true;
 }
 
 /**
- * removing a given thread to the map<id,thread>
- * @param tid the given thread index
- */
-void remove_thread_from_map(int tid){
-    thread_map->erase(tid);}
-
-/**
- * Adding a given thread id to the ready queue
- * @param cur_thread the given thread id
+ * Queues a file operation of the running thread. Nothing reaches the kernel before the next flush.
+ * @param op the operation
+ * @param fd the file descriptor
+ * @param buf the buffer to read into or write from
+ * @param count the buffer length
+ * @param offset the file offset
  */
-void add_thread_to_ready_queue(int  cur_thread)
+void queue_io_request(io_operation op, int fd, void *buf, size_t count, off_t offset)
 {
-    ready_queue->push_front(cur_thread);
+    thread_context *context = get_context(running_thread);
+    context->io_ticket++;
+    context->io_pending = true;
+    context->io_vec.iov_base = buf;
+    context->io_vec.iov_len = count;
+    io_in_flight++;
+    if (!io_uring_available)
+    {
+        io_request request = {running_thread->id, context->io_ticket, op, fd, context->io_vec, offset, 0};
+        push_io_request(&pool.unsubmitted, request);
+        return;
+    }
+    unsigned tail = *ring.sq_tail;
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = fd;
+    sqe->off = offset;
+    switch (op)
+    {
+        case IO_READ:
+            sqe->opcode = IORING_OP_READV;
+            break;
+        case IO_WRITE:
+            sqe->opcode = IORING_OP_WRITEV;
+            break;
+        case IO_FSYNC:
+            sqe->opcode = IORING_OP_FSYNC;
+            break;
+    }
+    if (op != IO_FSYNC)
+    {
+        sqe->addr = (unsigned long) &context->io_vec;
+        sqe->len = 1;
+    }
+    sqe->user_data = ((__u64) context->io_ticket << 32) | (unsigned) running_thread->id;
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.to_submit++;
 }
 
-
 /**
- * Adding a given thread id to the taken ids vector
- * @param id the given thread id
+ * Hands all the requests queued since the last flush to the kernel (or to the helper threads) at once.
+ * Runs in the timer signal handler. It allocates nothing, and the uthreads only take pool.lock with the timer signal
+ * masked, so the handler never waits for a lock held by the thread it interrupted.
  */
-void add_thread_id_to_taken_id(int id)
+void flush_io_requests()
 {
-    taken_ids->push_back(id);
+    if (!io_initialized)
+    {
+        return;
+    }
+    if (io_uring_available)
+    {
+        if (ring.to_submit > 0)
+        {
+            int ret = io_uring_enter(ring.fd, ring.to_submit, 0, 0);
+            if (ret > 0)
+            {
+                ring.to_submit -= ret;
+            }
+        }
+        return;
+    }
+    if (pool.unsubmitted.count == 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&pool.lock);
+    while (pool.unsubmitted.count > 0)
+    {
+        push_io_request(&pool.jobs, pop_io_request(&pool.unsubmitted));
+    }
+    pthread_cond_broadcast(&pool.has_jobs);
+    pthread_mutex_unlock(&pool.lock);
 }
 
-
-
-
-
 /**
- * @brief initializes the thread library.
- *
- * You may assume that this function is called before any other thread library function, and that it is called
- * exactly once.
- * The input to the function is the length of a quantum in micro-seconds.
- * It is an error to call this function with non-positive quantum_usecs.
- *
- * @return On success, return 0. On failure, return -1.
-*/
-int uthread_init(int quantum_usecs){
-
-    if(quantum_usecs<=0)
+ * Hands the result of a finished request to its thread and makes it READY again.
+ * @param tid the thread id of the request
+ * @param ticket the ticket of the request
+ * @param result bytes transferred or -errno
+ */
+void complete_io_request(int tid, unsigned ticket, ssize_t result)
+{
+    io_in_flight--;
+    thread_context *context = &thread_contexts[tid];
+    if (!context->io_pending || context->io_ticket != ticket)
     {
-        std::cerr << INIT_ERROR << std::endl;
-        return FAILURE;
+        return;
     }
-
-    // Global pointers initialization
-    ready_queue = new std::deque<int>;
-    sleep_map = new std::multimap<int, int>;
-    thread_map = new std::map<int,thread*>;
-    free_ids = new std::vector<int>;
-    taken_ids = new std::vector<int>;
-
-    // Fill all the possible ids
-    for (int i = 0; i<MAX_THREAD_NUM; i++)
+    context->io_pending = false;
+    if (context->io_orphaned) // nothing uses the buffer on its stack anymore
     {
-        add_id_to_free_id(i);
+        release_thread_resources(tid);
+        core.free_slot(tid);
+        return;
     }
+    context->io_result = result;
+    core.wake(tid);
+}
 
-    // Install timer_handler as the signal handler for SIGVTALRM.
-    sa.sa_handler = &sigvtalrm_handler;
-    if (sigaction(SIGVTALRM, &sa, NULL))
+/**
+ * Resumes the threads whose requests finished. Never blocks.
+ */
+void reap_io_completions()
+{
+    if (!io_initialized || io_in_flight == 0)
     {
-        std::cerr << SIGCATION_ERROR << std::endl;
-        clean_memory();
-        exit(1);
+        return;
     }
-
-    // Set empty set to mask signals
-    if(sigemptyset(&maskSignals))
+    if (io_uring_available)
     {
-        std::cerr << EMPTY_SET_ERROR << std::endl;
-        clean_memory();
-        exit(1);
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            complete_io_request((int) (cqe->user_data & 0xffffffff), (unsigned) (cqe->user_data >> 32), cqe->res);
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        return;
     }
-    // add SIGVTALARM to mask signals
-    if (sigaddset(&maskSignals, SIGVTALRM))
+    pthread_mutex_lock(&pool.lock);
+    while (pool.done.count > 0)
     {
-        std::cerr << SIG_ADD_SET_ERROR << std::endl;
-        clean_memory();
-        exit(1);
+        io_request request = pop_io_request(&pool.done);
+        complete_io_request(request.tid, request.ticket, request.result);
     }
-
-    // Configure the timer to expire after quantum_usecs... */
-    timer.it_value.tv_sec = ((long)quantum_usecs / 1000000); // first time interval, seconds part
-    timer.it_value.tv_usec = ((long)quantum_usecs % 1000000);        // first time interval, microseconds part
-
-    // configure the timer to expire every quantum_usecs after that.
-    timer.it_interval.tv_sec = ((long)quantum_usecs / 1000000);   // following time intervals, seconds part
-    timer.it_interval.tv_usec = ((long)quantum_usecs % 1000000);    // following time intervals, microseconds part
-
-    // Start a virtual timer. It counts down whenever this process is executing.
-    set_timer();
-
-    auto cur_thread = new thread ;
-    cur_thread->id =0;
-    cur_thread->num_of_quantum = 1;
-    cur_thread->state = RUNNING;
-    cur_thread->thread_func = nullptr;
-    set_thread_data(cur_thread);
-    //set_empty_signal_set(&cur_thread->env->__saved_mask);
-    total_quantum = 1;
-    add_thread_to_map(cur_thread);
-    add_thread_id_to_taken_id(cur_thread->id);
-    delete_id_from_free_id(cur_thread->id);
-    running_thread = cur_thread;
-    return SUCCESS;
+    pthread_mutex_unlock(&pool.lock);
 }
 
 /**
- * returns the minimum free id and delete it from the free id vector
- * If there is no free id then returns -1
+ * Blocks the whole process until at least one request finishes. Used when every thread is
+ * waiting for io and there is nothing else to run.
  */
-int get_min_id()
+void wait_for_io_completion()
 {
-    // There is no free id left
-    if (free_ids->empty())
+    flush_io_requests();
+    if (io_uring_available)
     {
-        return FAILURE;
+        io_uring_enter(ring.fd, ring.to_submit, 1, IORING_ENTER_GETEVENTS);
     }
-    int curr_min = MAX_THREAD_NUM;
-    int index = -1;
-    for (int i = 0; i < free_ids->size(); ++i) {
-        if(curr_min > (*free_ids)[i])
+    else
+    {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.done.count == 0)
         {
-            curr_min = (*free_ids)[i];
-            index = i;
+            pthread_cond_wait(&pool.has_done, &pool.lock);
         }
+        pthread_mutex_unlock(&pool.lock);
     }
-    delete_id_from_free_id(index);
-    return curr_min;
-
+    reap_io_completions();
 }
 
-
 /**
- * @brief Creates a new thread, whose entry point is the function entry_point with the signature
- * void entry_point(void).
- *
- * The thread is added to the end of the READY threads list.
- * The uthread_spawn function should fail if it would cause the number of concurrent threads to exceed the
- * limit (MAX_THREAD_NUM).
- * Each thread should be allocated with a stack of size STACK_SIZE bytes.
- *
- * @return On success, return the ID of the created thread. On failure, return -1.
-*/
-int uthread_spawn(thread_entry_point entry_point)
+ * Starts a new period of a given group, lifting its throttling
+ * @param group the given group
+ */
+void start_group_period(thread_group *group)
 {
-    mask_signals(true);
-    int thread_id= get_min_id(); // deletes the id from free_id vector and checks if there are ids left
-    if (thread_id == FAILURE)
+    if (group->throttled_since != -1) // throttled through total_quantum, the last quantum that started
     {
-        mask_signals(false);
-        return FAILURE;
+        group->throttled_quanta += total_quantum + 1 - group->throttled_since;
+        group->throttled_since = -1;
     }
-    char * stack = new char [STACK_SIZE];
-
-    auto cur_thread = new thread;
-    cur_thread->id = thread_id;
-    cur_thread->state = READY;
-    cur_thread->num_of_quantum=0;
-    cur_thread->stack = stack;
-    cur_thread->thread_func = entry_point;
-    setup_thread(cur_thread);
-    add_thread_to_map(cur_thread);
-    add_thread_to_ready_queue(cur_thread->id);
-    add_thread_id_to_taken_id(cur_thread->id);
-    mask_signals(false);
-
-    return SUCCESS;
+    group->period_start = total_quantum;
+    group->used = 0;
 }
 
 /**
- * This function does a self termination of a given thread id and makes the next
- * thread from the ready queue as the running thread.
- * @param tid The id of the thread that will terminate.
+ * Checks if the threads of a given group have to be skipped, like the cgroup cpu controller does once a
+ * group used up its quota. Starts the next period of the group when the current one is over.
+ * @param gid the given group id
+ * @return true if the group is out of quota for the current period
  */
-void self_termination(int tid)
+bool group_throttled(int gid)
 {
-    int next_thread_id = ready_queue->back(); // access
-    ready_queue->pop_back(); // erase
-    total_quantum++;
-    resuming_all_sleeping_threads();
-    add_id_to_free_id(tid);
-    delete_id_from_taken_id(tid);
-    remove_tid_from_ready_queue(tid);
-    thread *cur_thread =(*thread_map)[tid];
-    free_thread_stack(cur_thread);
-    remove_thread_from_map(tid);
-    auto next_thread_pointer = (*thread_map)[next_thread_id];
-    next_thread_pointer->state = RUNNING;
-    next_thread_pointer->num_of_quantum++;
-    set_timer();
-    running_thread = next_thread_pointer;
-    jump_to_thread(next_thread_pointer);
+    if (gid == NO_GROUP)
+    {
+        return false;
+    }
+    thread_group *group = &(*groups)[gid];
+    if (total_quantum - group->period_start >= group->period)
+    {
+        start_group_period(group);
+    }
+    return group->used >= group->quota;
+}
+
+/**
+ * Charges the quantum a given thread is starting to its group
+ * @param cur_thread the given thread
+ */
+void charge_group_quantum(thread *cur_thread)
+{
+    if (cur_thread->group == NO_GROUP)
+    {
+        return;
+    }
+    thread_group *group = &(*groups)[cur_thread->group];
+    group->used++;
+    group->consumed++;
+    if (group->used == group->quota) // this quantum is still its own, the next one is not
+    {
+        group->throttled_since = total_quantum + 1;
+    }
+}
+
+/**
+ * Checks if the budget of the current uthread_run_once call is used up
+ * @return true if the main thread has to get back to the host
+ */
+bool host_budget_spent()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > host_deadline.tv_sec ||
+           (now.tv_sec == host_deadline.tv_sec && now.tv_nsec >= host_deadline.tv_nsec);
+}
+
+/**
+ * Inside uthread_run_once, takes the main thread right away once the budget is spent - however many threads are
+ * READY. The main thread itself always hands the cpu to someone first.
+ * @return 0 if the main thread has to run next, NO_THREAD otherwise
+ */
+int uthreads_hooks::forced_pick(scheduler &)
+{
+    return hosting && running_thread->id != 0 && host_budget_spent() ? 0 : NO_THREAD;
+}
+
+/**
+ * Skips the threads of throttled groups, and inside uthread_run_once the main thread until nothing else can run
+ * @param tid the given READY thread id
+ * @return true if the thread may run now
+ */
+bool uthreads_hooks::eligible(scheduler &, int tid)
+{
+    if (tid == 0 && hosting && running_thread->id != 0)
+    {
+        return false;
+    }
+    return !group_throttled(threads[tid].group);
+}
+
+/**
+ * If every ready thread is throttled nothing else wants the cpu, so the groups of the ready threads start their
+ * next period right away instead of leaving the cpu idle. Other throttled groups keep their period.
+ * Inside uthread_run_once the host gets the cpu back instead.
+ * @return 0 to get back to the host, NO_THREAD to run the longest waiting thread
+ */
+int uthreads_hooks::fallback_pick(scheduler &)
+{
+    if (hosting && running_thread->id != 0) // the periods of the throttled groups advance with its next calls
+    {
+        return 0;
+    }
+    for (int i = 0; i < core.ready.size(); i++)
+    {
+        int gid = threads[core.ready.at(i)].group;
+        if (group_throttled(gid))
+        {
+            start_group_period(&(*groups)[gid]);
+        }
+    }
+    return NO_THREAD;
+}
+
+/**
+ * Rewrites the stats page under its sequence lock. Plain memory writes only, no system calls.
+ */
+void publish_stats()
+{
+    if (stats_page == nullptr || running_thread == nullptr) // uthread_init publishes the first state
+    {
+        return;
+    }
+    unsigned sequence = stats_page->sequence;
+    __atomic_store_n(&stats_page->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    stats_page->total_quantum = total_quantum;
+    stats_page->running_tid = running_thread->id;
+    stats_page->ready_threads = core.ready.size() + (core.run_next != NO_THREAD);
+    stats_page->sleeping_threads = core.sleepers.size();
+    stats_page->io_waiting_threads = io_in_flight;
+    std::fill(stats_page->state_counts, stats_page->state_counts + STATS_RUNNING + 1, 0);
+    for (int tid = 0; tid < scheduler::capacity; tid++)
+    {
+        // stats_thread_state mirrors thread_state, a thread waiting only for the completion of its io is gone
+        thread_state state = core.exists(tid) ? threads[tid].state : UNUSED;
+        stats_page->thread_states[tid] = state;
+        stats_page->thread_quanta[tid] = state == UNUSED ? 0 : threads[tid].num_of_quantum;
+        stats_page->state_counts[state]++;
+    }
+    __atomic_store_n(&stats_page->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Before every scheduling decision - releases the stack of a thread that terminated itself, and resumes the
+ * threads whose io completed.
+ */
+void uthreads_hooks::before_decision(scheduler &)
+{
+    release_retired_stack();
+    reap_io_completions();
+}
+
+/**
+ * Every thread waits for io - blocks the whole process until one of them can run.
+ */
+void uthreads_hooks::idle(scheduler &)
+{
+    wait_for_io_completion();
+}
+
+/**
+ * Restarts the timer, in order to get an entire quantum for the next running thread
+ */
+void uthreads_hooks::restart_quantum(scheduler &)
+{
+    set_timer();
+}
+
+/**
+ * Charges the quantum the new running thread starts to its group, and publishes the new state
+ */
+void uthreads_hooks::dispatched(scheduler &)
+{
+    charge_group_quantum(running_thread);
+    publish_stats();
+}
+
+/**
+ * This function handle the sigvt alarm sent by the timer.
+ * Set a new thread in running.
+ * @param sig the alarm index from
+ */
+void sigvtalrm_handler(int sig)
+{
+    if (timer_backend == TIMER_BACKEND_MONOTONIC || timer_backend == TIMER_BACKEND_CPUTIME)
+    {
+        // expirations while the signal was blocked or pending are merged into one signal - count them anyway
+        int overrun = timer_getoverrun(posix_timer_id);
+        if (overrun > 0)
+        {
+            total_quantum += overrun;
+        }
+    }
+    flush_io_requests(); // all the io requested during the quantum goes out in a single batch
+    core.schedule(true); // the kernel blocked the signal for the handler, and restores the mask when it returns
+}
+
+/**
+ * Gives a new thread a stack - a mapped private one, or the shared stack in shared stack mode - and fills a
+ * private stack with the canary when stack profiling is on.
+ * @param tid the id of the new thread
+ * @return the initial stack pointer of the thread
+ */
+address_t uthreads_hooks::prepare_stack(scheduler &, int tid)
+{
+    thread_context *context = &thread_contexts[tid];
+    context->on_shared_stack = shared_stack_mode;
+    context->stack = nullptr;
+    context->stack_profiled = false;
+    if (shared_stack_mode)
+    {
+        return (address_t) shared_stack + SHARED_STACK_SIZE - sizeof(address_t);
+    }
+    // mapped rather than taken from the heap, so that it can be released from the timer signal handler
+    void *memory = mmap(nullptr, scheduler::stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        core.report_error(STACK_ERROR);
+        clean_memory();
+        exit(1);
+    }
+    context->stack = (char *) memory;
+    context->stack_profiled = stack_profiling;
+    address_t sp = (address_t) context->stack + scheduler::stack_size - sizeof(address_t);
+    if (context->stack_profiled)
+    {
+        memset(context->stack, STACK_CANARY, scheduler::stack_size);
+        *(address_t *) sp = 0; // the return address of the entry point, where stack walks stop
+        stack_peaks->emplace(context->thread_func, 0);
+    }
+    return sp;
+}
+
+/**
+ * Returns the size class of a block holding size bytes
+ * @param size the requested size, at most SIZE_MAX - ALLOC_HEADER_SIZE
+ * @return the size class, ALLOC_LARGE if it is too big for the arena
+ */
+size_t get_size_class(size_t size)
+{
+    if (size > SIZE_MAX - ALLOC_HEADER_SIZE)
+    {
+        return ALLOC_LARGE;
+    }
+    size_t block = ALLOC_MIN_BLOCK;
+    for (size_t size_class = 0; size_class < ALLOC_CLASSES; size_class++, block <<= 1)
+    {
+        if (size + ALLOC_HEADER_SIZE <= block)
+        {
+            return size_class;
+        }
+    }
+    return ALLOC_LARGE;
+}
+
+/**
+ * Maps a new chunk and splits it into free blocks of a given size class. Signals must be masked.
+ * Never calls malloc - a preempted thread may be inside it.
+ * @param size_class the given size class
+ */
+void grow_arena(size_t size_class)
+{
+    void *memory = mmap(nullptr, ARENA_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        core.report_error(ARENA_ERROR);
+        clean_memory();
+        exit(1);
+    }
+    auto chunk = (char *) memory;
+    ((free_block *) chunk)->next = arena_chunks;
+    arena_chunks = (free_block *) chunk;
+    size_t block = (size_t) ALLOC_MIN_BLOCK << size_class;
+    for (size_t offset = block; offset + block <= ARENA_CHUNK_SIZE; offset += block) // first block links the chunk
+    {
+        auto cur_block = (free_block *) (chunk + offset);
+        cur_block->next = arena_free[size_class];
+        arena_free[size_class] = cur_block;
+    }
+}
+
+/**
+ * Takes a buffer for a saved stack from the arena, or maps one if it is larger than the largest block.
+ * Runs from the timer signal handler, so it never calls malloc. Signals must be masked.
+ * @param size the needed size
+ * @param capacity set to the usable size of the buffer
+ * @return the buffer
+ */
+char *get_save_buffer(size_t size, size_t *capacity)
+{
+    size_t size_class = 0;
+    size_t block = ALLOC_MIN_BLOCK;
+    for (; size_class < ALLOC_CLASSES && block < size; size_class++, block <<= 1)
+    {}
+    if (size_class == ALLOC_CLASSES)
+    {
+        *capacity = (size + SAVE_BUFFER_PAGE - 1) / SAVE_BUFFER_PAGE * SAVE_BUFFER_PAGE;
+        void *memory = mmap(nullptr, *capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+        {
+            core.report_error(ARENA_ERROR);
+            clean_memory();
+            exit(1);
+        }
+        return (char *) memory;
+    }
+    if (arena_free[size_class] == nullptr)
+    {
+        grow_arena(size_class);
+    }
+    free_block *cur_block = arena_free[size_class];
+    arena_free[size_class] = cur_block->next;
+    *capacity = block;
+    return (char *) cur_block;
+}
+
+/**
+ * Gives back a buffer taken with get_save_buffer. Signals must be masked.
+ * @param buffer the given buffer
+ * @param capacity its usable size
+ */
+void put_save_buffer(char *buffer, size_t capacity)
+{
+    size_t size_class = 0;
+    for (size_t block = ALLOC_MIN_BLOCK; size_class < ALLOC_CLASSES && block < capacity; size_class++, block <<= 1)
+    {}
+    if (size_class == ALLOC_CLASSES)
+    {
+        munmap(buffer, capacity);
+        return;
+    }
+    auto cur_block = (free_block *) buffer;
+    cur_block->next = arena_free[size_class];
+    arena_free[size_class] = cur_block;
+}
+
+/**
+ * Moves free blocks of a given size class from the arena to the cache of a given thread
+ * @param context the cold block of the given thread
+ * @param size_class the given size class
+ */
+void refill_alloc_cache(thread_context *context, size_t size_class)
+{
+    mask_signals(true);
+    if (arena_free[size_class] == nullptr)
+    {
+        grow_arena(size_class);
+    }
+    for (int i = 0; i < ALLOC_REFILL_BLOCKS && arena_free[size_class] != nullptr; i++)
+    {
+        free_block *cur_block = arena_free[size_class];
+        arena_free[size_class] = cur_block->next;
+        cur_block->next = context->alloc_cache[size_class];
+        context->alloc_cache[size_class] = cur_block;
+        context->alloc_cached[size_class]++;
+    }
+    mask_signals(false);
+}
+
+/**
+ * Moves up to count cached blocks of a given size class from a given thread back to the arena.
+ * Signals must be masked.
+ * @param context the cold block of the given thread
+ * @param size_class the given size class
+ * @param count the number of blocks to return
+ */
+void return_alloc_cache(thread_context *context, size_t size_class, int count)
+{
+    for (int i = 0; i < count && context->alloc_cache[size_class] != nullptr; i++)
+    {
+        free_block *cur_block = context->alloc_cache[size_class];
+        context->alloc_cache[size_class] = cur_block->next;
+        cur_block->next = arena_free[size_class];
+        arena_free[size_class] = cur_block;
+    }
+    context->alloc_cached[size_class] = std::max(context->alloc_cached[size_class] - count, 0);
+}
+
+/**
+ * Releasing the control block slot of a given thread id
+ * @param tid the given thread index
+ */
+void release_thread_slot(int tid){
+    thread_contexts[tid].thread_func = nullptr;
+    thread_contexts[tid].io_pending = false; // a late completion of this thread is dropped
+    thread_contexts[tid].io_orphaned = false;
+    if (thread_contexts[tid].io_bounce != nullptr)
+    {
+        put_save_buffer(thread_contexts[tid].io_bounce, thread_contexts[tid].io_bounce_capacity);
+        thread_contexts[tid].io_bounce = nullptr;
+    }
+    for (size_t size_class = 0; size_class < ALLOC_CLASSES; size_class++)
+    {
+        return_alloc_cache(&thread_contexts[tid], size_class, INT_MAX);
+    }
+}
+
+/**
+ * Releases everything a terminated thread owns - its stack and its control block slot
+ * @param tid the given thread id
+ */
+void release_thread_resources(int tid)
+{
+    free_thread_stack(&threads[tid]);
+    release_thread_slot(tid);
+}
+
+/**
+ * Releases a terminated thread, unless it waits for a file operation. The kernel (or a helper thread) may still
+ * read or write a buffer on its stack, and the request may not even be submitted yet. The thread is gone from now
+ * on, but its stack and id wait for the completion.
+ * @param tid the given thread id
+ * @return true if the thread was released
+ */
+bool uthreads_hooks::release_thread(scheduler &, int tid)
+{
+    if (thread_contexts[tid].io_pending)
+    {
+        thread_contexts[tid].io_orphaned = true;
+        return false;
+    }
+    release_thread_resources(tid);
+    return true;
+}
+
+
+/**
+ * @brief initializes the thread library.
+ *
+ * You may assume that this function is called before any other thread library function, and that it is called
+ * exactly once.
+ * The input to the function is the length of a quantum in micro-seconds.
+ * It is an error to call this function with non-positive quantum_usecs.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_init(int quantum_usecs){
+
+    if(quantum_usecs<=0)
+    {
+        core.report_error(INIT_ERROR);
+        return FAILURE;
+    }
+
+    // Global pointers initialization
+    stack_peaks = new std::map<thread_entry_point, int>;
+    groups = new std::vector<thread_group>;
+
+    // Install timer_handler as the signal handler for SIGVTALRM.
+    sa.sa_handler = &sigvtalrm_handler;
+    if (timer_backend != TIMER_BACKEND_NONE && sigaction(SIGVTALRM, &sa, NULL))
+    {
+        core.report_error(SIGCATION_ERROR);
+        clean_memory();
+        exit(1);
+    }
+
+    // Set empty set to mask signals
+    if(sigemptyset(&maskSignals))
+    {
+        core.report_error(EMPTY_SET_ERROR);
+        clean_memory();
+        exit(1);
+    }
+    // add SIGVTALARM to mask signals
+    if (sigaddset(&maskSignals, SIGVTALRM))
+    {
+        core.report_error(SIG_ADD_SET_ERROR);
+        clean_memory();
+        exit(1);
+    }
+
+    if (shared_stack_mode)
+    {
+        shared_stack = new char[SHARED_STACK_SIZE];
+        // the return address of every entry point on the shared stack, where stack walks stop
+        *(address_t *) (shared_stack + SHARED_STACK_SIZE - sizeof(address_t)) = 0;
+        switch_stack = new char[scheduler::stack_size];
+        // like the first jump into a thread, but the timer signal stays blocked while the trampoline copies
+        sigsetjmp(switch_env,timer_backend != TIMER_BACKEND_NONE);
+        address_t sp = (address_t) switch_stack + scheduler::stack_size - sizeof(address_t);
+        (switch_env->__jmpbuf)[JB_SP] = translate_address(sp);
+        (switch_env->__jmpbuf)[JB_PC] = translate_address((address_t) shared_stack_trampoline);
+        switch_env->__saved_mask = maskSignals;
+    }
+
+    // Configure the timer to expire after quantum_usecs... */
+    timer.it_value.tv_sec = ((long)quantum_usecs / 1000000); // first time interval, seconds part
+    timer.it_value.tv_usec = ((long)quantum_usecs % 1000000);        // first time interval, microseconds part
+
+    // configure the timer to expire every quantum_usecs after that.
+    timer.it_interval.tv_sec = ((long)quantum_usecs / 1000000);   // following time intervals, seconds part
+    timer.it_interval.tv_usec = ((long)quantum_usecs % 1000000);    // following time intervals, microseconds part
+
+    // Same quantum in nanoseconds for the posix timers, as a relative deadline with the same period
+    posix_timer.it_value.tv_sec = ((long)quantum_usecs / 1000000);
+    posix_timer.it_value.tv_nsec = ((long)quantum_usecs % 1000000) * 1000;
+    posix_timer.it_interval = posix_timer.it_value;
+    quantum_length = quantum_usecs;
+    if (timer_backend == TIMER_BACKEND_MONOTONIC || timer_backend == TIMER_BACKEND_CPUTIME)
+    {
+        struct sigevent event{};
+        event.sigev_notify = SIGEV_SIGNAL;
+        event.sigev_signo = SIGVTALRM;
+        clockid_t clock = timer_backend == TIMER_BACKEND_MONOTONIC ? CLOCK_MONOTONIC : CLOCK_PROCESS_CPUTIME_ID;
+        if (timer_create(clock, &event, &posix_timer_id))
+        {
+            core.report_error(TIMER_ERROR);
+            clean_memory();
+            exit(1);
+        }
+        posix_timer_created = true;
+    }
+
+    // Start a virtual timer. It counts down whenever this process is executing.
+    set_timer();
+
+    core.start();
+    threads[0].group = NO_GROUP;
+    publish_stats(); // the page may have been enabled before uthread_init
+    return SUCCESS;
+}
+
+
+/**
+ * Creates a new READY thread in a given group. Signals must be masked by the caller.
+ * @param entry_point the thread function
+ * @param gid the group id, or NO_GROUP
+ * @return the id of the created thread, or -1 if there is no free id
+ */
+int spawn_thread(thread_entry_point entry_point, int gid)
+{
+    int thread_id = core.spawn(entry_point); // the lowest free id
+    if (thread_id == NO_THREAD)
+    {
+        return FAILURE;
+    }
+    threads[thread_id].group = gid;
+    return thread_id;
+}
+
+/**
+ * @brief Creates a new thread, whose entry point is the function entry_point with the signature
+ * void entry_point(void).
+ *
+ * The thread is added to the end of the READY threads list.
+ * The uthread_spawn function should fail if it would cause the number of concurrent threads to exceed the
+ * limit (MAX_THREAD_NUM).
+ * Each thread should be allocated with a stack of size STACK_SIZE bytes.
+ *
+ * @return On success, return the ID of the created thread. On failure, return -1.
+*/
+int uthread_spawn(thread_entry_point entry_point)
+{
+    mask_signals(true);
+    int thread_id = spawn_thread(entry_point, NO_GROUP);
+    mask_signals(false);
+    return thread_id == FAILURE ? FAILURE : SUCCESS;
+}
+
+/**
+ * @brief Creates a thread group limited to quota_quanta quanta in every period of period_quanta quanta.
+ *
+ * Periods are counted in quanta, like uthread_sleep. Once the threads of a group started quota_quanta quanta in
+ * the current period the group is throttled - its threads are skipped by the scheduler until the next period.
+ * It is an error to call this function with a non-positive quota or period.
+ *
+ * @return On success, return the ID of the created group. On failure, return -1.
+*/
+int uthread_group_create(int quota_quanta, int period_quanta)
+{
+    if (quota_quanta <= 0 || period_quanta <= 0)
+    {
+        core.report_error(GROUP_ERROR_1);
+        return FAILURE;
+    }
+    mask_signals(true);
+    thread_group group = {quota_quanta, period_quanta, total_quantum, 0, 0, 0, -1};
+    groups->push_back(group);
+    int gid = (int) groups->size() - 1;
+    mask_signals(false);
+    return gid;
+}
+
+/**
+ * @brief Creates a new thread in the group with ID gid, exactly like uthread_spawn.
+ *
+ * It is an error if no group with ID gid exists.
+ *
+ * @return On success, return the ID of the created thread. On failure, return -1.
+*/
+int uthread_spawn_in_group(int gid, thread_entry_point entry_point)
+{
+    mask_signals(true);
+    if (gid < 0 || gid >= (int) groups->size())
+    {
+        core.report_error(GROUP_ERROR_2);
+        mask_signals(false);
+        return FAILURE;
+    }
+    int thread_id = spawn_thread(entry_point, gid);
+    mask_signals(false);
+    return thread_id;
+}
+
+/**
+ * @brief Returns the number of quanta the threads of the group with ID gid started since it was created.
+ *
+ * It is an error if no group with ID gid exists.
+ *
+ * @return On success, return the consumed quanta. On failure, return -1.
+*/
+int uthread_group_get_consumed(int gid)
+{
+    mask_signals(true);
+    if (gid < 0 || gid >= (int) groups->size())
+    {
+        core.report_error(GROUP_ERROR_2);
+        mask_signals(false);
+        return FAILURE;
+    }
+    int consumed = (*groups)[gid].consumed;
+    mask_signals(false);
+    return consumed;
+}
+
+/**
+ * @brief Returns the number of quanta the group with ID gid spent throttled, including the current throttling.
+ *
+ * It is an error if no group with ID gid exists.
+ *
+ * @return On success, return the throttled quanta. On failure, return -1.
+*/
+int uthread_group_get_throttled(int gid)
+{
+    mask_signals(true);
+    if (gid < 0 || gid >= (int) groups->size())
+    {
+        core.report_error(GROUP_ERROR_2);
+        mask_signals(false);
+        return FAILURE;
+    }
+    thread_group *group = &(*groups)[gid];
+    int throttled = group->throttled_quanta;
+    if (group->throttled_since != -1)
+    {
+        throttled += total_quantum + 1 - group->throttled_since;
+    }
+    mask_signals(false);
+    return throttled;
+}
+
+/**
+ * @brief Terminates the thread with ID tid and deletes it from all relevant control structures.
+ *
+ * All the resources allocated by the library for this thread should be released. If no thread with ID tid exists it
+ * is considered an error. Terminating the main thread (tid == 0) will result in the termination of the entire
+ * process using exit(0) (after releasing the assigned library memory).
+ * A thread waiting in uthread_pread, uthread_pwrite or uthread_fsync keeps its stack and its ID until the file
+ * operation completes, since the kernel may still use a buffer on that stack.
+ *
+ * @return The function returns 0 if the thread was successfully terminated and -1 otherwise. If a thread terminates
+ * itself or the main thread is terminated, the function does not return.
+*/
+int uthread_terminate(int tid)
+{
+    mask_signals(true);
+
+    // Case thread 0
+    if(tid == 0)
+    {
+        if (stack_profiling)
+        {
+            dump_stack_usage();
+        }
+        clean_memory();
+        core.report_error(TERMINATION_ERROR_1);
+        exit(0);
+    }
+
+    // Case the tid does not exist
+    if (!core.exists(tid))
+    {
+        core.report_error(TERMINATION_ERROR_2);
+        mask_signals(false);
+        return FAILURE;
+    }
+
+    //Case self termination
+    if(running_thread->id == tid)
+    {
+        core.exit_running();
+    }
+    core.terminate(tid);
+    mask_signals(false);
+    return SUCCESS;
+}
+
+
+/**
+ * @brief Blocks the thread with ID tid. The thread may be resumed later using uthread_resume.
+ *
+ * If no thread with ID tid exists it is considered as an error. In addition, it is an error to try blocking the
+ * main thread (tid == 0). If a thread blocks itself, a scheduling decision should be made. Blocking a thread in
+ * BLOCKED state has no effect and is not considered an error.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_block(int tid)
+{
+    mask_signals(true);
+
+    // Case thread 0 - Not allowed
+    if(tid == 0)
+    {
+        core.report_error(BLOCK_ERROR_1);
+        mask_signals(false);
+        return FAILURE;
+    }
+
+    // Case the tid does not exist
+    if (!core.exists(tid))
+    {
+        core.report_error(BLOCK_ERROR_2);
+        mask_signals(false);
+        return FAILURE;
+    }
+
+    core.block(tid); // a scheduling decision if the thread blocks itself
+    mask_signals(false);
+    return SUCCESS;
+}
+
+//void print_hallo()
+//{
+//    std::cout << "T Function" << std::endl;
+//}
+
+/**
+ * @brief Resumes a blocked thread with ID tid and moves it to the READY state.
+ *
+ * Resuming a thread in a RUNNING or READY state has no effect and is not considered as an error. If no thread with
+ * ID tid exists it is considered an error.
+ * The resumed thread is the next one to run when the calling thread gives up the cpu before its quantum is over
+ * (by blocking, sleeping, yielding or terminating), and it runs for the rest of that quantum. This makes a
+ * producer waking its consumer a single switch. A thread resumed earlier and still waiting for that turn goes to
+ * the end of the READY threads list.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_resume(int tid)
+{
+    mask_signals(true);
+
+    // Case the tid does not exist
+    if (!core.exists(tid))
+    {
+        core.report_error(RESUME_ERROR);
+        mask_signals(false);
+        return FAILURE;
+    }
+    if (!thread_contexts[tid].io_pending) // io waiters wake on completion
+    {
+        core.resume(tid);
+    }
+    mask_signals(false);
+    return SUCCESS;
+}
+
+
+/**
+ * @brief Blocks the RUNNING thread for num_quantums quantums.
+ *
+ * Immediately after the RUNNING thread transitions to the BLOCKED state a scheduling decision should be made.
+ * After the sleeping time is over, the thread should go back to the end of the READY threads list.
+ * The number of quantums refers to the number of times a new quantum starts, regardless of the reason. Specifically,
+ * the quantum of the thread which has made the call to uthread_sleep isn’t counted.
+ * It is considered an error if the main thread (tid==0) calls this function.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_sleep(int num_quantums)
+{
+    mask_signals(true); // todo check if everyone sleeps
+    // Case thread 0
+    if(running_thread->id == 0)
+    {
+        clean_memory();
+        core.report_error(SLEEP_ERROR);
+        mask_signals(false);
+        return FAILURE;
+    }
+    core.sleep(num_quantums); // scheduling decision
+    mask_signals(false);
+    return SUCCESS;
+}
+
+
+/**
+ * @brief Returns the thread ID of the calling thread.
+ *
+ * @return The ID of the calling thread.
+*/
+int uthread_get_tid()
+{
+    return running_thread->id;
+}
+
+
+/**
+ * @brief Returns the total number of quantums since the library was initialized, including the current quantum.
+ *
+ * Right after the call to uthread_init, the value should be 1.
+ * Each time a new quantum starts, regardless of the reason, this number should be increased by 1.
+ *
+ * @return The total number of quantums.
+*/
+int uthread_get_total_quantums()
+{
+    return total_quantum;
+}
+
+
+
+/**
+ * @brief Returns the number of quantums the thread with ID tid was in RUNNING state.
+ *
+ * On the first time a thread runs, the function should return 1. Every additional quantum that the thread starts should
+ * increase this value by 1 (so if the thread with ID tid is in RUNNING state when this function is called, include
+ * also the current quantum). If no thread with ID tid exists it is considered an error.
+ *
+ * @return On success, return the number of quantums of the thread with ID tid. On failure, return -1.
+*/
+int uthread_get_quantums(int tid)
+{
+    mask_signals(true);
+
+    // Case the tid does not exist
+    if (!core.exists(tid))
+    {
+        core.report_error(GET_QUANTUM_ERROR);
+        mask_signals(false);
+        return FAILURE;
+    }
+
+    thread* cur_thread = &threads[tid];
+    if(cur_thread->state == RUNNING)
+    {
+        mask_signals(false);
+        return cur_thread->num_of_quantum + 1;
+    }
     mask_signals(false);
+    return cur_thread->num_of_quantum;
+
+}
+
+/**
+ * Returns the bounds of the stack a given thread runs on
+ * @param cur_thread the given thread
+ * @param low set to the lowest address of the stack
+ * @param high set to the address right after the stack
+ */
+void get_stack_bounds(thread *cur_thread, address_t *low, address_t *high)
+{
+    thread_context *context = get_context(cur_thread);
+    if (context->on_shared_stack)
+    {
+        *low = (address_t) shared_stack;
+        *high = *low + SHARED_STACK_SIZE;
+    }
+    else if (context->stack != nullptr)
+    {
+        *low = (address_t) context->stack;
+        *high = *low + STACK_SIZE;
+    }
+    else // the main thread runs on the process stack
+    {
+        *low = main_stack_low;
+        *high = main_stack_high;
+    }
+}
+
+/**
+ * This function handle the sigprof sent by the profiling timer.
+ * Records the running thread and its call stack, walking the frame pointer chain only inside the bounds of the
+ * stack of the thread, so a sample taken in the middle of a switch is cut short instead of faulting.
+ * With ITIMER_VIRTUAL both timers expire on the same tick, and SIGPROF is then delivered on top of SIGVTALRM,
+ * before the first instruction of sigvtalrm_handler. The sample is taken from the context SIGVTALRM interrupted.
+ * @param sig the signal index
+ * @param info the signal info
+ * @param ucontext the interrupted context
+ */
+void sigprof_handler(int sig, siginfo_t *info, void *ucontext)
+{
+    if (profile_count >= PROFILER_MAX_SAMPLES)
+    {
+        profile_dropped = profile_dropped + 1;
+        return;
+    }
+    thread *cur_thread = running_thread;
+    profile_sample *sample = &profile_samples[profile_count];
+    sample->tid = cur_thread->id;
+    sample->entry_point = get_context(cur_thread)->thread_func;
+    address_t low, high;
+    get_stack_bounds(cur_thread, &low, &high);
+    auto registers = ((ucontext_t *) ucontext)->uc_mcontext.gregs;
+    if ((address_t) registers[REG_RIP] == (address_t) &sigvtalrm_handler)
+    {
+        // the stack pointer is at the return address of the SIGVTALRM signal frame, its ucontext comes next
+        auto timer_context = (ucontext_t *) (registers[REG_RSP] + sizeof(address_t));
+        registers = timer_context->uc_mcontext.gregs;
+    }
+    sample->frames[0] = (address_t) registers[REG_RIP];
+    int depth = 1;
+    auto frame = (address_t) registers[REG_RBP];
+    while (depth < PROFILER_MAX_DEPTH && frame >= low && frame + 2 * sizeof(address_t) <= high &&
+           frame % sizeof(address_t) == 0)
+    {
+        auto links = (address_t *) frame; // saved frame pointer, then return address
+        if (links[1] == 0)
+        {
+            break;
+        }
+        sample->frames[depth++] = links[1];
+        if (links[0] <= frame) // frames only go up the stack
+        {
+            break;
+        }
+        frame = links[0];
+    }
+    sample->depth = depth;
+    profile_count = profile_count + 1;
+}
+
+/**
+ * Returns a printable name of a code address
+ * @param addr the given address
+ * @return the symbol name if it is exported, the address otherwise
+ */
+std::string symbol_name(address_t addr)
+{
+    Dl_info info;
+    if (dladdr((void *) addr, &info) && info.dli_sname != nullptr)
+    {
+        return info.dli_sname;
+    }
+    std::ostringstream name;
+    name << (void *) addr;
+    return name.str();
 }
 
-
 /**
- * @brief Terminates the thread with ID tid and deletes it from all relevant control structures.
+ * @brief Starts sampling the running thread every interval_usecs micro-seconds of process cpu time.
  *
- * All the resources allocated by the library for this thread should be released. If no thread with ID tid exists it
- * is considered an error. Terminating the main thread (tid == 0) will result in the termination of the entire
- * process using exit(0) (after releasing the assigned library memory).
+ * Driven by SIGPROF (setitimer(ITIMER_PROF)). Each sample holds the ID of the running thread, its entry point
+ * and its call stack, unwound through the frame pointers - compile with -fno-omit-frame-pointer (and link with
+ * -rdynamic for function names). Up to PROFILER_MAX_SAMPLES samples are kept, from a buffer allocated here.
+ * Starting again discards the previous samples.
  *
- * @return The function returns 0 if the thread was successfully terminated and -1 otherwise. If a thread terminates
- * itself or the main thread is terminated, the function does not return.
+ * @return On success, return 0. On failure, return -1.
 */
-int uthread_terminate(int tid)
+int uthread_profiler_start(int interval_usecs)
 {
+    if (interval_usecs <= 0)
+    {
+        core.report_error(PROFILER_ERROR_1);
+        return FAILURE;
+    }
     mask_signals(true);
-
-    // Case thread 0
-    if(tid == 0)
+    if (profile_samples == nullptr)
     {
+        profile_samples = new profile_sample[PROFILER_MAX_SAMPLES];
+        pthread_attr_t attributes;
+        void *stack_low;
+        size_t stack_size;
+        pthread_getattr_np(pthread_self(), &attributes);
+        pthread_attr_getstack(&attributes, &stack_low, &stack_size);
+        pthread_attr_destroy(&attributes);
+        main_stack_low = (address_t) stack_low;
+        main_stack_high = main_stack_low + stack_size;
+    }
+    profile_count = 0;
+    profile_dropped = 0;
+    struct sigaction prof_action{};
+    prof_action.sa_sigaction = &sigprof_handler;
+    prof_action.sa_flags = SA_SIGINFO | SA_RESTART;
+    if (sigaction(SIGPROF, &prof_action, NULL))
+    {
+        core.report_error(SIGCATION_ERROR);
         clean_memory();
-        std::cerr << TERMINATION_ERROR_1 << std::endl;
-        exit(0);
+        exit(1);
     }
-
-    // Case the tid does not exist
-    if (thread_map->find(tid) == thread_map->end())
+    struct itimerval prof_timer;
+    prof_timer.it_value.tv_sec = interval_usecs / 1000000;
+    prof_timer.it_value.tv_usec = interval_usecs % 1000000;
+    prof_timer.it_interval = prof_timer.it_value;
+    if (setitimer(ITIMER_PROF, &prof_timer, NULL))
     {
-        std::cerr << TERMINATION_ERROR_2 << std::endl;
-        mask_signals(false);
-        return FAILURE;
+        core.report_error(TIMER_ERROR);
+        clean_memory();
+        exit(1);
     }
+    mask_signals(false);
+    return SUCCESS;
+}
 
-    int tid_running_thread = running_thread->id;
-    //Case self termination
-    if(tid_running_thread == tid)
+/**
+ * @brief Stops the sampling started by uthread_profiler_start. The samples are kept for uthread_profiler_dump.
+ *
+ * @return 0.
+*/
+int uthread_profiler_stop()
+{
+    struct itimerval prof_timer{};
+    setitimer(ITIMER_PROF, &prof_timer, NULL);
+    signal(SIGPROF, SIG_IGN); // a signal already on its way is dropped
+    return SUCCESS;
+}
+
+/**
+ * @brief Writes the samples to path in the collapsed stack format of flame graph tools.
+ *
+ * Each line is "uthread_<tid>;<entry point>;<outermost frame>;...;<innermost frame> <count>". Samples dropped
+ * because the buffer was full are reported on stderr.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_profiler_dump(const char *path)
+{
+    std::ofstream output(path);
+    if (!output)
     {
-        self_termination(tid);
-        return SUCCESS;
+        core.report_error(PROFILER_ERROR_2);
+        return FAILURE;
     }
-    thread *cur_thread =(*thread_map)[tid];
-    free_thread_stack(cur_thread);
-    if (cur_thread->stack != NULL) //todo delete
+    std::map<std::string, int> stacks;
+    int count = std::min((int) profile_count, PROFILER_MAX_SAMPLES);
+    for (int i = 0; i < count; i++)
+    {
+        profile_sample *sample = &profile_samples[i];
+        std::string stack = "uthread_" + std::to_string(sample->tid) + ";" +
+                            (sample->entry_point == nullptr ? "main" : symbol_name((address_t) sample->entry_point));
+        for (int depth = sample->depth - 1; depth >= 0; depth--)
         {
-        mask_signals(false);
-//        std::cout<<"stack not null"<<std::endl;
+            stack += ";" + symbol_name(sample->frames[depth]);
         }
-    delete cur_thread;
-    cur_thread = nullptr;
-    if (cur_thread!= nullptr) //todo delete
+        stacks[stack]++;
+    }
+    for (auto &itr : stacks)
     {
-        mask_signals(false);
-        std::cout<<"im not null"<<std::endl;
+        output << itr.first << " " << itr.second << std::endl;
+    }
+    if (profile_dropped > 0)
+    {
+        std::cerr << "profiler: " << profile_dropped << " samples dropped, the buffer is full" << std::endl;
     }
-    remove_thread_from_map(tid);
-    add_id_to_free_id(tid);
-    delete_id_from_taken_id(tid);
-    remove_tid_from_ready_queue(tid);
-    mask_signals(false);
     return SUCCESS;
 }
 
-
 /**
- * @brief Blocks the thread with ID tid. The thread may be resumed later using uthread_resume.
+ * @brief Gives up the cpu - the calling thread goes to the end of the READY threads list and a scheduling decision
+ * is made.
  *
- * If no thread with ID tid exists it is considered as an error. In addition, it is an error to try blocking the
- * main thread (tid == 0). If a thread blocks itself, a scheduling decision should be made. Blocking a thread in
- * BLOCKED state has no effect and is not considered an error.
+ * This is how threads share the cpu when the library runs without a timer (TIMER_BACKEND_NONE).
  *
- * @return On success, return 0. On failure, return -1.
+ * @return 0.
 */
-int uthread_block(int tid)
+int uthread_yield()
 {
     mask_signals(true);
+    core.schedule(); // scheduling decision
+    mask_signals(false);
+    return SUCCESS;
+}
 
-    // Case thread 0 - Not allowed
-    if(tid == 0)
+/**
+ * @brief Runs the READY threads cooperatively for up to budget_usecs micro-seconds, then returns to the host.
+ *
+ * Must be called by the main thread, with TIMER_BACKEND_NONE. Threads are switched whenever one yields, blocks,
+ * sleeps or terminates, and the call returns at the first switch after the budget is spent, or when no other
+ * thread is READY. A thread is never interrupted, so the budget may be overrun by the thread running when it
+ * expires. A budget of 0 runs a single thread. It is an error to call this function with a negative budget.
+ * File operations requested by the threads are submitted before returning.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_run_once(int budget_usecs)
+{
+    if (timer_backend != TIMER_BACKEND_NONE || running_thread->id != 0)
     {
-        std::cerr << BLOCK_ERROR_1 << std::endl;
-        mask_signals(false);
+        core.report_error(RUN_ONCE_ERROR_1);
         return FAILURE;
     }
-
-    // Case the tid does not exist
-    if (thread_map->find(tid) == thread_map->end())
+    if (budget_usecs < 0)
     {
-        std::cerr << BLOCK_ERROR_2 << std::endl;
-        mask_signals(false);
+        core.report_error(RUN_ONCE_ERROR_2);
         return FAILURE;
     }
+    clock_gettime(CLOCK_MONOTONIC, &host_deadline);
+    long nsecs = host_deadline.tv_nsec + (long) budget_usecs * 1000;
+    host_deadline.tv_sec += nsecs / 1000000000;
+    host_deadline.tv_nsec = nsecs % 1000000000;
+    hosting = true;
+    flush_io_requests();
+    core.schedule(); // the main thread is picked again once the budget is spent
+    hosting = false;
+    flush_io_requests(); // all the io requested during the call goes out in a single batch
+    return SUCCESS;
+}
 
-    thread *curr_tread = (*thread_map)[tid];
-    if(curr_tread->state == BLOCKED)
-    {
-        return SUCCESS;
-    }else if(curr_tread->state == RUNNING)
+/**
+ * @brief Returns how long the host may block before it has to call uthread_run_once again.
+ *
+ * Meant as the timeout of the host's epoll_wait: 0 if some thread is READY, the quantum length passed to
+ * uthread_init if threads are sleeping or waiting for file operations (sleeping is counted in quanta, and every
+ * uthread_run_once call is at least one), and -1 if nothing can become READY without the host.
+ *
+ * @return The timeout in micro-seconds, or -1 for no timeout.
+*/
+int uthread_next_deadline()
+{
+    mask_signals(true);
+    reap_io_completions();
+    int deadline = -1;
+    if (core.has_ready())
     {
-        set_timer(); // restarting the timer in order to get an entire quantum for the next running thread
-        curr_tread->state = BLOCKED;
-        next_running_thread();
-    }else // Was in READY
+        deadline = 0;
+    }
+    else if (!core.sleepers.empty() || io_in_flight > 0)
     {
-        curr_tread->state = BLOCKED;
-        remove_tid_from_ready_queue(curr_tread->id);
-        mask_signals(false);
+        deadline = quantum_length;
     }
     mask_signals(false);
-    return SUCCESS;
+    return deadline;
 }
 
-//void print_hallo()
-//{
-//    std::cout << "T Function" << std::endl;
-//}
-
 /**
- * @brief Resumes a blocked thread with ID tid and moves it to the READY state.
+ * @brief Selects the clock that drives preemption. Must be called before uthread_init.
  *
- * Resuming a thread in a RUNNING or READY state has no effect and is not considered as an error. If no thread with
- * ID tid exists it is considered an error.
+ * TIMER_BACKEND_ITIMER (the default) uses setitimer(ITIMER_VIRTUAL). TIMER_BACKEND_MONOTONIC and
+ * TIMER_BACKEND_CPUTIME use a posix timer on CLOCK_MONOTONIC or CLOCK_PROCESS_CPUTIME_ID, which supports
+ * quanta well below 100 microseconds. With the posix timers, expirations missed while the process was busy or
+ * had the signal blocked still count towards the total number of quantums.
+ * TIMER_BACKEND_NONE installs no signal handler and arms no timer. The threads are then never preempted: the
+ * host calls uthread_run_once from the main thread, e.g. between two epoll_wait calls, and each thread runs
+ * until it yields, blocks, sleeps or terminates. Each such scheduling decision is a quantum.
  *
  * @return On success, return 0. On failure, return -1.
 */
-int uthread_resume(int tid)
+int uthread_set_timer_backend(int backend)
 {
-    mask_signals(true);
-
-    // Case the tid does not exist
-    if (thread_map->find(tid) == thread_map->end())
+    if (backend < TIMER_BACKEND_ITIMER || backend > TIMER_BACKEND_NONE)
     {
-        std::cerr << RESUME_ERROR << std::endl;
-        mask_signals(false);
+        core.report_error(TIMER_BACKEND_ERROR);
         return FAILURE;
     }
-    thread *curr_tread = (*thread_map)[tid];
-    if (curr_tread->state == BLOCKED)
-    {
-        curr_tread->state = READY;
-        add_thread_to_ready_queue(curr_tread->id);
-        mask_signals(false);
-        return SUCCESS;
-    }
-    mask_signals(false);
+    timer_backend = backend;
     return SUCCESS;
 }
 
+/**
+ * @brief Makes every spawned thread run on one shared stack. Must be called before uthread_init.
+ *
+ * A thread does not own a STACK_SIZE stack. When another thread needs the shared stack, only the live part of
+ * the previous owner's stack is copied out into a buffer of the same size, and copied back before it runs again.
+ * Mostly idle threads then cost only their live stack bytes, for the price of a copy when switching between
+ * threads on the shared stack. The main thread keeps running on the process stack.
+ * Buffers handed to uthread_pread / uthread_pwrite may live on the stack - such a request goes through a bounce
+ * buffer, as the kernel may write it while another thread owns the shared stack. Threads in this mode are not
+ * covered by stack profiling.
+ *
+ * @return 0.
+*/
+int uthread_enable_shared_stack()
+{
+    shared_stack_mode = true;
+    return SUCCESS;
+}
 
 /**
- * @brief Blocks the RUNNING thread for num_quantums quantums.
+ * @brief Returns the number of bytes kept aside for the stack of the thread with ID tid in shared stack mode.
  *
- * Immediately after the RUNNING thread transitions to the BLOCKED state a scheduling decision should be made.
- * After the sleeping time is over, the thread should go back to the end of the READY threads list.
- * The number of quantums refers to the number of times a new quantum starts, regardless of the reason. Specifically,
- * the quantum of the thread which has made the call to uthread_sleep isn’t counted.
- * It is considered an error if the main thread (tid==0) calls this function.
+ * This is the memory an idle thread costs in shared stack mode - the buffer its live stack is saved into, which
+ * is replaced by a smaller one when the live stack shrinks well below it. It is an error if no thread with ID tid
+ * exists.
  *
- * @return On success, return 0. On failure, return -1.
+ * @return On success, return the size in bytes. On failure, return -1.
 */
-int uthread_sleep(int num_quantums)
+int uthread_get_saved_stack_size(int tid)
 {
-    mask_signals(true); // todo check if everyone sleeps
-    // Case thread 0
-    if(running_thread->id == 0)
+    mask_signals(true);
+    if (!core.exists(tid))
     {
-        clean_memory();
-        std::cerr << SLEEP_ERROR << std::endl;
+        core.report_error(SAVED_STACK_ERROR);
         mask_signals(false);
         return FAILURE;
     }
-    int wake_up_quantum = total_quantum+num_quantums+1;
-    sleep_map->insert(make_pair(wake_up_quantum, running_thread->id));
-    running_thread->state = BLOCKED;
-    set_timer(); // Set timer in order to get an entire quantum, for next running thread
-    next_running_thread(); // scheduling decision
+    int size = (int) thread_contexts[tid].saved_capacity;
     mask_signals(false);
-    return SUCCESS;
+    return size;
 }
 
-
 /**
- * @brief Returns the thread ID of the calling thread.
+ * @brief Returns the number of stack copies (to and from the shared stack) done since the library was initialized.
  *
- * @return The ID of the calling thread.
+ * Together with uthread_get_stack_copy_bytes this gives the average copy cost of a switch in shared stack mode.
+ *
+ * @return The number of stack copies.
 */
-int uthread_get_tid()
+long uthread_get_stack_copies()
 {
-    return running_thread->id;
+    return stack_copies;
 }
 
+/**
+ * @brief Returns the total number of bytes copied to and from the shared stack since the library was initialized.
+ *
+ * @return The number of copied bytes.
+*/
+long uthread_get_stack_copy_bytes()
+{
+    return stack_copy_bytes;
+}
 
 /**
- * @brief Returns the total number of quantums since the library was initialized, including the current quantum.
+ * @brief Allocates size bytes, like malloc, in a way that is safe under preemption by the thread library.
  *
- * Right after the call to uthread_init, the value should be 1.
- * Each time a new quantum starts, regardless of the reason, this number should be increased by 1.
+ * Blocks of up to 4080 bytes come from a cache owned by the calling thread, which no other thread touches, so
+ * a preemption in the middle of an allocation is harmless and no signal masking is needed. The caches are
+ * refilled in batches from an arena shared by all the threads. Larger blocks are taken from malloc with the
+ * timer signal masked. Cached blocks go back to the arena when the thread is terminated.
  *
- * @return The total number of quantums.
+ * @return On success, return a pointer to the allocated memory. On failure, return nullptr.
 */
-int uthread_get_total_quantums()
+void *uthread_malloc(size_t size)
 {
-    return total_quantum;
+    if (size > SIZE_MAX - ALLOC_HEADER_SIZE) // the header would not fit
+    {
+        return nullptr;
+    }
+    size_t size_class = get_size_class(size);
+    thread *cur_thread = running_thread; // stays the same for as long as we are running
+    if (size_class == ALLOC_LARGE || cur_thread == nullptr)
+    {
+        mask_signals(true);
+        auto header = (alloc_header *) malloc(size + ALLOC_HEADER_SIZE);
+        mask_signals(false);
+        if (header == nullptr)
+        {
+            return nullptr;
+        }
+        header->size_class = ALLOC_LARGE;
+        return (char *) header + ALLOC_HEADER_SIZE;
+    }
+    thread_context *context = get_context(cur_thread);
+    if (context->alloc_cache[size_class] == nullptr)
+    {
+        refill_alloc_cache(context, size_class);
+    }
+    free_block *cur_block = context->alloc_cache[size_class];
+    context->alloc_cache[size_class] = cur_block->next;
+    context->alloc_cached[size_class]--;
+    auto header = (alloc_header *) cur_block;
+    header->size_class = size_class;
+    return (char *) header + ALLOC_HEADER_SIZE;
 }
 
-
+/**
+ * @brief Frees a block returned by uthread_malloc, like free. Freeing nullptr has no effect.
+ *
+ * The block goes to the cache of the calling thread, whichever thread allocated it.
+*/
+void uthread_free(void *ptr)
+{
+    if (ptr == nullptr)
+    {
+        return;
+    }
+    auto header = (alloc_header *) ((char *) ptr - ALLOC_HEADER_SIZE);
+    size_t size_class = header->size_class;
+    thread *cur_thread = running_thread;
+    if (size_class == ALLOC_LARGE || cur_thread == nullptr)
+    {
+        mask_signals(true);
+        if (size_class == ALLOC_LARGE)
+        {
+            free(header);
+        }
+        else
+        {
+            auto cur_block = (free_block *) header;
+            cur_block->next = arena_free[size_class];
+            arena_free[size_class] = cur_block;
+        }
+        mask_signals(false);
+        return;
+    }
+    thread_context *context = get_context(cur_thread);
+    auto cur_block = (free_block *) header;
+    cur_block->next = context->alloc_cache[size_class];
+    context->alloc_cache[size_class] = cur_block;
+    if (++context->alloc_cached[size_class] > ALLOC_CACHE_LIMIT)
+    {
+        mask_signals(true);
+        return_alloc_cache(context, size_class, ALLOC_CACHE_LIMIT / 2);
+        mask_signals(false);
+    }
+}
 
 /**
- * @brief Returns the number of quantums the thread with ID tid was in RUNNING state.
+ * @brief Publishes the scheduler state in a shared memory page, /dev/shm/uthreads.<pid>.
  *
- * On the first time a thread runs, the function should return 1. Every additional quantum that the thread starts should
- * increase this value by 1 (so if the thread with ID tid is in RUNNING state when this function is called, include
- * also the current quantum). If no thread with ID tid exists it is considered an error.
+ * The page (see uthreads_stats.h) is updated on every scheduling decision and can be sampled by another process
+ * at any rate, for example with uthreads_top. It is removed when the main thread is terminated. May be called
+ * before or after uthread_init - before it, the page is created empty and filled in by uthread_init.
  *
- * @return On success, return the number of quantums of the thread with ID tid. On failure, return -1.
+ * @return 0.
 */
-int uthread_get_quantums(int tid)
+int uthread_enable_stats_page()
 {
     mask_signals(true);
+    if (stats_page != nullptr)
+    {
+        mask_signals(false);
+        return SUCCESS;
+    }
+    snprintf(stats_page_name, sizeof(stats_page_name), STATS_PAGE_NAME_FORMAT, (int) getpid());
+    int fd = shm_open(stats_page_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(uthreads_stats_page)))
+    {
+        core.report_error(STATS_PAGE_ERROR);
+        clean_memory();
+        exit(1);
+    }
+    void *page = mmap(nullptr, sizeof(uthreads_stats_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED)
+    {
+        core.report_error(STATS_PAGE_ERROR);
+        clean_memory();
+        exit(1);
+    }
+    stats_page = (uthreads_stats_page *) page;
+    stats_page->max_threads = scheduler::capacity;
+    publish_stats();
+    mask_signals(false);
+    return SUCCESS;
+}
 
-    // Case the tid does not exist
-    if (thread_map->find(tid) == thread_map->end())
+/**
+ * @brief Turns on stack high water mark profiling for every thread spawned from now on.
+ *
+ * The stack of each new thread is filled with a canary pattern, so the deepest point the thread ever reached can
+ * be read with uthread_get_stack_usage. When the main thread is terminated, the peak usage of each entry point is
+ * printed to stderr.
+ *
+ * @return 0.
+*/
+int uthread_enable_stack_profiling()
+{
+    stack_profiling = true;
+    return SUCCESS;
+}
+
+/**
+ * @brief Returns the highest number of stack bytes the thread with ID tid has used so far.
+ *
+ * It is an error if no thread with ID tid exists or if it was spawned without stack profiling (this includes the
+ * main thread, which runs on the process stack).
+ *
+ * @return On success, return the stack high water mark in bytes. On failure, return -1.
+*/
+int uthread_get_stack_usage(int tid)
+{
+    mask_signals(true);
+    if (!core.exists(tid) || !thread_contexts[tid].stack_profiled)
     {
-        std::cerr << GET_QUANTUM_ERROR << std::endl;
+        core.report_error(STACK_USAGE_ERROR);
         mask_signals(false);
         return FAILURE;
     }
+    int usage = measure_stack_usage(&threads[tid]);
+    mask_signals(false);
+    return usage;
+}
 
-    thread* cur_thread = (*thread_map)[tid];
-    if(cur_thread->state == RUNNING)
+/**
+ * Checks if a given buffer overlaps the shared stack
+ * @param buf the given buffer
+ * @param count its size
+ * @return true if it does
+ */
+bool on_shared_stack(const void *buf, size_t count)
+{
+    auto low = (const char *) buf;
+    return shared_stack != nullptr && low < shared_stack + SHARED_STACK_SIZE && low + count > shared_stack;
+}
+
+/**
+ * Parks the running thread until its file operation completes, letting the other threads run meanwhile.
+ * A buffer on the shared stack is swapped for a bounce buffer from the arena, since the kernel (or a helper thread)
+ * may touch it while another thread owns the shared stack.
+ * @return bytes transferred (0 for fsync) on success, -1 with errno set on failure
+ */
+ssize_t park_on_io(io_operation op, int fd, void *buf, size_t count, off_t offset)
+{
+    mask_signals(true);
+    init_io();
+    thread_context *context = get_context(running_thread);
+    void *io_buf = buf;
+    if (context->on_shared_stack && on_shared_stack(buf, count))
     {
-        mask_signals(false);
-        return cur_thread->num_of_quantum + 1;
+        context->io_bounce = get_save_buffer(count, &context->io_bounce_capacity);
+        if (op == IO_WRITE)
+        {
+            memcpy(context->io_bounce, buf, count);
+        }
+        io_buf = context->io_bounce;
+    }
+    queue_io_request(op, fd, io_buf, count, offset);
+    core.block(running_thread->id); // scheduling decision, returns after the completion resumed us
+    ssize_t result = context->io_result;
+    if (context->io_bounce != nullptr)
+    {
+        if (op == IO_READ && result > 0)
+        {
+            memcpy(buf, context->io_bounce, result);
+        }
+        put_save_buffer(context->io_bounce, context->io_bounce_capacity);
+        context->io_bounce = nullptr;
     }
     mask_signals(false);
-    return cur_thread->num_of_quantum;
+    if (result < 0)
+    {
+        errno = (int) -result;
+        return FAILURE;
+    }
+    return result;
+}
+
+/**
+ * @brief Reads up to count bytes from fd at offset into buf, like pread(2).
+ *
+ * Only the calling thread waits for the disk - it is parked and the other threads keep running until the read
+ * completes. Requests of all the threads in one quantum are submitted together.
+ *
+ * @return On success, return the number of bytes read. On failure, return -1 and set errno.
+*/
+ssize_t uthread_pread(int fd, void *buf, size_t count, off_t offset)
+{
+    return park_on_io(IO_READ, fd, buf, count, offset);
+}
+
+/**
+ * @brief Writes up to count bytes from buf to fd at offset, like pwrite(2).
+ *
+ * Only the calling thread waits for the disk, as in uthread_pread.
+ *
+ * @return On success, return the number of bytes written. On failure, return -1 and set errno.
+*/
+ssize_t uthread_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    return park_on_io(IO_WRITE, fd, const_cast<void *>(buf), count, offset);
+}
 
+/**
+ * @brief Flushes the data of fd to the disk, like fsync(2).
+ *
+ * Only the calling thread waits for the disk, as in uthread_pread.
+ *
+ * @return On success, return 0. On failure, return -1 and set errno.
+*/
+int uthread_fsync(int fd)
+{
+    return (int) park_on_io(IO_FSYNC, fd, nullptr, 0, 0);
 }
 
 /****************************** Functions for test only **************************************************************/
@@ -0,0 +1,147 @@
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include "uthreads_core.h"
+
+/**
+ * Measures the switch path of scheduler cores built for purely cooperative threads - nothing preempts them, so
+ * they use no_masking and the switch path makes no system call at all.
+ *   lifo         no_masking + lifo_policy. The threads hand a token around a ring with block and resume - each
+ *                hand off is one switch into the run next slot.
+ *   round robin  no_masking + round_robin_policy. Every thread yields in a loop.
+ * Needs nothing but uthreads_core.h.
+ * Usage: uthreads_bench_coop [threads] [rounds]
+ */
+
+#define USAGE_ERROR "usage: uthreads_bench_coop [threads] [rounds]"
+#define BENCH_CAPACITY 64
+#define BENCH_STACK_SIZE (64 * 1024)
+#define DEFAULT_THREADS 8
+#define DEFAULT_ROUNDS 200000
+#define FAILURE (-1)
+#define SUCCESS 0
+
+typedef struct{
+    int id;
+    thread_state state;
+    int num_of_quantum;
+}coop_thread;
+
+typedef struct{
+    char *stack;
+    void (*thread_func) ();
+    sigjmp_buf env;
+}coop_context;
+
+template <class Policy>
+struct coop_config{
+    typedef coop_thread thread_type;
+    typedef coop_context context_type;
+    typedef Policy policy;
+    typedef no_masking masking;
+    typedef default_hooks hooks;
+    static constexpr int capacity = BENCH_CAPACITY;
+    static constexpr int stack_size = BENCH_STACK_SIZE;
+    static constexpr bool report_errors = false;
+    static constexpr bool tracing = false;
+};
+
+basic_scheduler<coop_config<lifo_policy>> lifo_core;
+basic_scheduler<coop_config<round_robin_policy>> round_robin_core;
+
+int thread_count;
+long rounds;
+int alive;
+volatile int token;
+
+/**
+ * Ends a worker - the last one wakes the main thread up
+ */
+template <class Scheduler>
+void finish(Scheduler &core)
+{
+    if (--alive == 0)
+    {
+        core.resume(0);
+    }
+    core.exit_running();
+}
+
+/**
+ * Waits for the token, passes it to the next thread of the ring (threads 1 to thread_count) and wakes it up
+ */
+void ring_worker()
+{
+    int me = lifo_core.running->id;
+    int next = me % thread_count + 1;
+    for (long round = 0; round < rounds; round++)
+    {
+        while (token != me)
+        {
+            lifo_core.block(me);
+        }
+        token = next;
+        lifo_core.resume(next);
+    }
+    finish(lifo_core);
+}
+
+/**
+ * Gives up the cpu rounds times
+ */
+void yield_worker()
+{
+    for (long round = 0; round < rounds; round++)
+    {
+        round_robin_core.schedule();
+    }
+    finish(round_robin_core);
+}
+
+/**
+ * Runs the workers on a given core from the main thread until all of them are done, and prints the switch rate
+ * @param core the given core, started
+ * @param name the name of the configuration
+ * @param worker the thread function
+ */
+template <class Scheduler>
+void run(Scheduler &core, const char *name, void (*worker)())
+{
+    alive = thread_count;
+    token = 1;
+    for (int i = 0; i < thread_count; i++)
+    {
+        core.spawn(worker);
+    }
+    struct timespec start, end;
+    int first_quantum = core.total_quantum;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    core.block(0); // the last worker to finish resumes us
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    int switches = core.total_quantum - first_quantum;
+    double nsecs = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    printf("%-12s %10d switches %8.1f ns per switch\n", name, switches, nsecs / switches);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 3)
+    {
+        std::cerr << USAGE_ERROR << std::endl;
+        return FAILURE;
+    }
+    thread_count = argc > 1 ? atoi(argv[1]) : DEFAULT_THREADS;
+    rounds = argc > 2 ? atol(argv[2]) : DEFAULT_ROUNDS;
+    if (thread_count < 2 || thread_count >= BENCH_CAPACITY || rounds <= 0) // a ring of one never switches
+    {
+        std::cerr << USAGE_ERROR << std::endl;
+        return FAILURE;
+    }
+    printf("%d threads, %ld rounds each\n", thread_count, rounds);
+    lifo_core.start();
+    run(lifo_core, "lifo", ring_worker);
+    round_robin_core.start();
+    run(round_robin_core, "round robin", yield_worker);
+    return SUCCESS;
+}
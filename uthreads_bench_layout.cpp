@@ -0,0 +1,302 @@
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csetjmp>
+#include <map>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/**
+ * Compares the cache behaviour of the thread control block layouts on the two paths of the scheduler that touch
+ * many threads: the scan over every thread (stats page, throttled group skip, sleep wake up) and the context
+ * switch (hot block of the old and the new thread, then the saved context of the new one).
+ *   map     the original layout - one heap allocated block per thread, found through a std::map
+ *   padded  hot blocks in an array, each padded to its own cache line, cold blocks in a second array
+ *   packed  the same split, with the 16 byte hot blocks packed four to a cache line
+ * Every measured pass starts with cold caches, as the scheduler does after a quantum of user code.
+ * Usage: uthreads_bench_layout [threads] [rounds]
+ */
+
+#define CACHE_LINE_SIZE 64
+#define FLUSH_SIZE (32 * 1024 * 1024) // well above the last level cache
+#define DEFAULT_THREADS 100
+#define DEFAULT_ROUNDS 200
+#define USAGE_ERROR "usage: uthreads_bench_layout [threads] [rounds]"
+#define FAILURE (-1)
+#define SUCCESS 0
+
+enum thread_state {
+    UNUSED,
+    READY,
+    BLOCKED,
+    RUNNING
+};
+
+// The control block before the split - hot fields and saved context together.
+typedef struct{
+    int id;
+    thread_state state;
+    int num_of_quantum;
+    char *stack;
+    void (*thread_func) ();
+    sigjmp_buf env;
+}fat_thread;
+
+typedef struct alignas(CACHE_LINE_SIZE){
+    int id;
+    thread_state state;
+    int num_of_quantum;
+    int group;
+}padded_thread;
+
+typedef struct{
+    int id;
+    thread_state state;
+    int num_of_quantum;
+    int group;
+}packed_thread;
+
+typedef struct{
+    char *stack;
+    void (*thread_func) ();
+    sigjmp_buf env;
+}cold_thread;
+
+typedef struct{
+    double cycles; // nanoseconds, if the cycle counter is not available
+    double misses;
+}measurement;
+
+char *flush_buffer;
+volatile long sink;
+int cycles_fd = -1;
+int misses_fd = -1;
+
+/**
+ * Opens a hardware counter of the calling process
+ * @return the counter file descriptor, -1 if perf events are not available
+ */
+int open_counter(unsigned type, unsigned long long config)
+{
+    struct perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/**
+ * Evicts everything the previous pass left in the caches
+ */
+void flush_caches()
+{
+    for (long i = 0; i < FLUSH_SIZE; i += CACHE_LINE_SIZE)
+    {
+        flush_buffer[i]++;
+    }
+}
+
+/**
+ * Reads a counter, or the monotonic clock when there is no counter
+ */
+long long read_counter(int fd)
+{
+    long long value = 0;
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000000000LL + now.tv_nsec;
+    }
+    return value;
+}
+
+/**
+ * Runs a pass rounds times from cold caches and returns the average cost of one pass
+ * @param pass the measured code
+ * @param rounds the number of measured passes
+ */
+template <class Pass>
+measurement measure(Pass pass, int rounds)
+{
+    measurement total = {0, 0};
+    for (int round = 0; round < rounds; round++)
+    {
+        flush_caches();
+        if (cycles_fd >= 0)
+        {
+            ioctl(cycles_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(misses_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(cycles_fd, PERF_EVENT_IOC_ENABLE, 0);
+            ioctl(misses_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        long long start = cycles_fd >= 0 ? 0 : read_counter(-1);
+        pass();
+        if (cycles_fd >= 0)
+        {
+            ioctl(cycles_fd, PERF_EVENT_IOC_DISABLE, 0);
+            ioctl(misses_fd, PERF_EVENT_IOC_DISABLE, 0);
+            total.cycles += (double) read_counter(cycles_fd);
+            total.misses += (double) read_counter(misses_fd);
+        }
+        else
+        {
+            total.cycles += (double) (read_counter(-1) - start);
+        }
+    }
+    total.cycles /= rounds;
+    total.misses /= rounds;
+    return total;
+}
+
+/**
+ * Prints one line of the result table
+ */
+void print_result(const char *layout, const char *path, measurement result)
+{
+    if (misses_fd >= 0)
+    {
+        printf("%-8s %-8s %12.0f %12.1f\n", layout, path, result.cycles, result.misses);
+    }
+    else
+    {
+        printf("%-8s %-8s %12.0f %12s\n", layout, path, result.cycles, "n/a");
+    }
+}
+
+/**
+ * Builds a scheduling order that visits every thread once, in a shuffled order like a ready queue after a while
+ */
+void build_order(int *order, int threads)
+{
+    for (int i = 0; i < threads; i++)
+    {
+        order[i] = i;
+    }
+    srand(1);
+    for (int i = threads - 1; i > 0; i--)
+    {
+        int j = rand() % (i + 1);
+        std::swap(order[i], order[j]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 3)
+    {
+        std::cerr << USAGE_ERROR << std::endl;
+        return FAILURE;
+    }
+    int thread_count = argc > 1 ? atoi(argv[1]) : DEFAULT_THREADS;
+    int rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_ROUNDS;
+    if (thread_count <= 0 || rounds <= 0)
+    {
+        std::cerr << USAGE_ERROR << std::endl;
+        return FAILURE;
+    }
+    flush_buffer = new char[FLUSH_SIZE]();
+    cycles_fd = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    misses_fd = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    if (cycles_fd < 0 || misses_fd < 0)
+    {
+        close(cycles_fd);
+        close(misses_fd);
+        cycles_fd = misses_fd = -1;
+    }
+
+    std::map<int, fat_thread *> thread_map;
+    auto padded = new padded_thread[thread_count];
+    auto packed = new packed_thread[thread_count];
+    auto cold = new cold_thread[thread_count];
+    for (int tid = 0; tid < thread_count; tid++)
+    {
+        thread_map[tid] = new fat_thread{tid, READY, 0, nullptr, nullptr, {}};
+        padded[tid] = {tid, READY, 0, -1};
+        packed[tid] = {tid, READY, 0, -1};
+    }
+    auto order = new int[thread_count];
+    build_order(order, thread_count);
+
+    printf("%d threads, %d cold cache passes each, %s per pass\n\n", thread_count, rounds,
+           cycles_fd >= 0 ? "cycles and L1D read misses" : "nanoseconds (perf events unavailable)");
+    printf("%-8s %-8s %12s %12s\n", "LAYOUT", "PATH", cycles_fd >= 0 ? "CYCLES" : "NSECS", "MISSES");
+
+    // scan: how many threads are READY - what publish_stats and the throttled group skip do per decision
+    print_result("map", "scan", measure([&]() {
+        long ready = 0;
+        for (auto &itr : thread_map)
+        {
+            ready += itr.second->state == READY;
+        }
+        sink = ready;
+    }, rounds));
+    print_result("padded", "scan", measure([&]() {
+        long ready = 0;
+        for (int tid = 0; tid < thread_count; tid++)
+        {
+            ready += padded[tid].state == READY;
+        }
+        sink = ready;
+    }, rounds));
+    print_result("packed", "scan", measure([&]() {
+        long ready = 0;
+        for (int tid = 0; tid < thread_count; tid++)
+        {
+            ready += packed[tid].state == READY;
+        }
+        sink = ready;
+    }, rounds));
+
+    // switch: every thread once in ready queue order - old RUNNING -> READY, new READY -> RUNNING, read its context
+    print_result("map", "switch", measure([&]() {
+        long pc = 0;
+        fat_thread *running = thread_map[order[0]];
+        for (int i = 1; i < thread_count; i++)
+        {
+            fat_thread *next = (*thread_map.find(order[i])).second;
+            running->state = READY;
+            next->state = RUNNING;
+            next->num_of_quantum++;
+            pc += next->env->__jmpbuf[7];
+            running = next;
+        }
+        sink = pc;
+    }, rounds));
+    print_result("padded", "switch", measure([&]() {
+        long pc = 0;
+        padded_thread *running = &padded[order[0]];
+        for (int i = 1; i < thread_count; i++)
+        {
+            padded_thread *next = &padded[order[i]];
+            running->state = READY;
+            next->state = RUNNING;
+            next->num_of_quantum++;
+            pc += cold[next->id].env->__jmpbuf[7];
+            running = next;
+        }
+        sink = pc;
+    }, rounds));
+    print_result("packed", "switch", measure([&]() {
+        long pc = 0;
+        packed_thread *running = &packed[order[0]];
+        for (int i = 1; i < thread_count; i++)
+        {
+            packed_thread *next = &packed[order[i]];
+            running->state = READY;
+            next->state = RUNNING;
+            next->num_of_quantum++;
+            pc += cold[next->id].env->__jmpbuf[7];
+            running = next;
+        }
+        sink = pc;
+    }, rounds));
+    return SUCCESS;
+}
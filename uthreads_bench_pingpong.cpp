@@ -0,0 +1,141 @@
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include "uthreads.h"
+
+/**
+ * Measures how fast a pair of threads hand work to each other with uthread_resume and uthread_block, while spinner
+ * threads compete for the cpu. A round is the producer handing the turn to the consumer and the consumer handing
+ * it back. The quanta of the spinners show whether the pair starves the others.
+ * Resuming a READY thread has no effect, so a wake up sent while the partner is between checking the turn and
+ * blocking is lost. The main thread resumes both once in each of its quanta, so that costs a cycle, not a hang.
+ * Each thread of the pair publishes its own id, uthread_spawn does not return it.
+ * Link with uthreads.cpp.
+ * Usage: uthreads_bench_pingpong [spinners] [seconds] [quantum_usecs]
+ */
+
+#define USAGE_ERROR "usage: uthreads_bench_pingpong [spinners] [seconds] [quantum_usecs]"
+#define DEFAULT_SPINNERS 8
+#define DEFAULT_SECONDS 2
+#define DEFAULT_QUANTUM_USECS 2000
+#define FAILURE (-1)
+#define SUCCESS 0
+
+#define PRODUCER_TURN 0
+#define CONSUMER_TURN 1
+
+volatile long rounds = 0;
+volatile int turn = PRODUCER_TURN;
+volatile int producer_tid = 0; // 0 until the thread first runs
+volatile int consumer_tid = 0;
+
+/**
+ * Burns its quanta, competing with the pair
+ */
+void spinner()
+{
+    while (true)
+    {}
+}
+
+/**
+ * Hands the turn to the consumer and waits for it back, counting the rounds
+ */
+void producer()
+{
+    producer_tid = uthread_get_tid();
+    while (consumer_tid == 0)
+    {}
+    while (true)
+    {
+        while (turn != PRODUCER_TURN)
+        {
+            uthread_block(producer_tid);
+        }
+        rounds++;
+        turn = CONSUMER_TURN;
+        uthread_resume(consumer_tid);
+    }
+}
+
+/**
+ * Hands the turn back to the producer and waits for the next one
+ */
+void consumer()
+{
+    consumer_tid = uthread_get_tid();
+    while (producer_tid == 0)
+    {}
+    while (true)
+    {
+        while (turn != CONSUMER_TURN)
+        {
+            uthread_block(consumer_tid);
+        }
+        turn = PRODUCER_TURN;
+        uthread_resume(producer_tid);
+    }
+}
+
+/**
+ * Busy waits in the main thread, which takes its turns like every other thread. Resumes the pair once in each of
+ * its quanta, in case a wake up was lost.
+ * @param seconds the wall clock time to wait
+ */
+void run_for(int seconds)
+{
+    struct timespec start, now;
+    int last_quantum = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do
+    {
+        if (uthread_get_total_quantums() != last_quantum && producer_tid != 0 && consumer_tid != 0)
+        {
+            last_quantum = uthread_get_total_quantums();
+            uthread_resume(producer_tid);
+            uthread_resume(consumer_tid);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+    while (now.tv_sec - start.tv_sec < seconds);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 4)
+    {
+        std::cerr << USAGE_ERROR << std::endl;
+        return FAILURE;
+    }
+    int spinners = argc > 1 ? atoi(argv[1]) : DEFAULT_SPINNERS;
+    int seconds = argc > 2 ? atoi(argv[2]) : DEFAULT_SECONDS;
+    int quantum_usecs = argc > 3 ? atoi(argv[3]) : DEFAULT_QUANTUM_USECS;
+    if (spinners < 0 || spinners > MAX_THREAD_NUM - 3 || seconds <= 0 || quantum_usecs <= 0)
+    {
+        std::cerr << USAGE_ERROR << std::endl;
+        return FAILURE;
+    }
+    uthread_init(quantum_usecs);
+    for (int i = 0; i < spinners; i++)
+    {
+        uthread_spawn(spinner);
+    }
+    uthread_spawn(producer);
+    uthread_spawn(consumer);
+    run_for(seconds);
+
+    int spinner_quanta = 0;
+    for (int tid = 1; tid <= spinners; tid++)
+    {
+        spinner_quanta += uthread_get_quantums(tid);
+    }
+    printf("%d spinners, %d s, quantum %d us\n", spinners, seconds, quantum_usecs);
+    printf("rounds %ld (%.0f per second)\n", (long) rounds, (double) rounds / seconds);
+    printf("quanta: spinners %d, producer %d, consumer %d, main %d, total %d\n", spinner_quanta,
+           uthread_get_quantums(producer_tid), uthread_get_quantums(consumer_tid), uthread_get_quantums(0),
+           uthread_get_total_quantums());
+    fflush(stdout);
+    uthread_terminate(0);
+    return SUCCESS;
+}
@@ -0,0 +1,153 @@
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include "uthreads_ext.h"
+
+/**
+ * Measures what shared stack mode costs and saves. For each stack depth, threads many threads descend that many
+ * frames and then idle there, yielding in a loop while the main thread drives them with uthread_run_once - a
+ * mostly idle thread that wakes up, finds nothing to do and gives the cpu back.
+ *   bytes per idle thread  the average uthread_get_saved_stack_size, against the STACK_SIZE a private stack costs
+ *   bytes per switch       the bytes copied to and from the shared stack (uthread_get_stack_copy_bytes)
+ *   ns per switch          the wall clock time of a switch, copies included
+ * Every thread publishes its own id, uthread_spawn does not return it.
+ * Link with uthreads.cpp.
+ * Usage: uthreads_bench_sharedstack [threads] [rounds]
+ */
+
+#define USAGE_ERROR "usage: uthreads_bench_sharedstack [threads] [rounds]"
+#define DEFAULT_THREADS 32
+#define DEFAULT_ROUNDS 200
+#define ROUND_BUDGET_USECS 1000
+#define FRAME_BYTES 128
+#define FAILURE (-1)
+#define SUCCESS 0
+
+const int depths[] = {0, 16, 64, 256}; // frames of at least FRAME_BYTES each
+
+int thread_count;
+int rounds;
+int phase_depth;
+volatile bool phase_active;
+volatile int arrived;
+volatile int alive;
+volatile int tids[MAX_THREAD_NUM];
+
+/**
+ * Publishes the id of the running thread and yields until the phase ends
+ */
+void idle()
+{
+    tids[arrived++] = uthread_get_tid();
+    while (phase_active)
+    {
+        uthread_yield();
+    }
+}
+
+/**
+ * Descends a given number of frames, then idles at the bottom
+ * @param depth the given number of frames
+ */
+void descend(int depth)
+{
+    volatile char frame[FRAME_BYTES];
+    frame[0] = (char) depth;
+    if (depth > 0)
+    {
+        descend(depth - 1);
+    }
+    else
+    {
+        idle();
+    }
+    frame[FRAME_BYTES - 1] = frame[0]; // keeps the frame alive across the call
+}
+
+/**
+ * Runs the phase at the current depth, then terminates itself
+ */
+void worker()
+{
+    descend(phase_depth);
+    alive--;
+    uthread_terminate(uthread_get_tid());
+}
+
+/**
+ * Spawns the threads at a given depth, lets them idle there for the rounds and prints the costs
+ * @param depth the given depth
+ */
+void run(int depth)
+{
+    phase_depth = depth;
+    phase_active = true;
+    arrived = 0;
+    alive = thread_count;
+    for (int i = 0; i < thread_count; i++)
+    {
+        uthread_spawn(worker);
+    }
+    while (arrived < thread_count)
+    {
+        uthread_run_once(ROUND_BUDGET_USECS);
+    }
+
+    struct timespec start, end;
+    int first_quantum = uthread_get_total_quantums();
+    long first_copies = uthread_get_stack_copies();
+    long first_bytes = uthread_get_stack_copy_bytes();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int round = 0; round < rounds; round++)
+    {
+        uthread_run_once(ROUND_BUDGET_USECS);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    int switches = uthread_get_total_quantums() - first_quantum;
+    long copies = uthread_get_stack_copies() - first_copies;
+    long bytes = uthread_get_stack_copy_bytes() - first_bytes;
+    double nsecs = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+
+    long saved = 0;
+    for (int i = 0; i < thread_count; i++)
+    {
+        saved += uthread_get_saved_stack_size(tids[i]);
+    }
+    phase_active = false;
+    while (alive > 0)
+    {
+        uthread_run_once(ROUND_BUDGET_USECS);
+    }
+    printf("%5d %16ld %10d %10.2f %16.1f %14.1f\n", depth, saved / thread_count, switches,
+           (double) copies / switches, (double) bytes / switches, nsecs / switches);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 3)
+    {
+        std::cerr << USAGE_ERROR << std::endl;
+        return FAILURE;
+    }
+    thread_count = argc > 1 ? atoi(argv[1]) : DEFAULT_THREADS;
+    rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_ROUNDS;
+    if (thread_count < 2 || thread_count >= MAX_THREAD_NUM || rounds <= 0) // a single thread never switches
+    {
+        std::cerr << USAGE_ERROR << std::endl;
+        return FAILURE;
+    }
+    uthread_set_timer_backend(TIMER_BACKEND_NONE);
+    uthread_enable_shared_stack();
+    uthread_init(ROUND_BUDGET_USECS);
+    printf("%d threads, %d rounds of %d us, private stacks cost %d bytes per thread\n", thread_count, rounds,
+           ROUND_BUDGET_USECS, STACK_SIZE);
+    printf("depth  bytes per thread   switches  copies/sw   bytes per switch  ns per switch\n");
+    for (int depth : depths)
+    {
+        run(depth);
+    }
+    fflush(stdout);
+    uthread_terminate(0);
+    return SUCCESS;
+}
@@ -0,0 +1,709 @@
+#ifndef _UTHREADS_CORE_H
+#define _UTHREADS_CORE_H
+
+#include <iostream>
+#include <cstdlib>
+#include <csetjmp>
+#include <signal.h>
+
+#define CACHE_LINE_SIZE 64
+#define JB_SP 6
+#define JB_PC 7
+#define NO_THREAD (-1)
+
+/*
+ * Compile time configurable core of the scheduler. Everything the hot paths depend on is a template parameter, so
+ * a binary with its own needs gets a fully inlined switch path without paying for the generality of the others.
+ *
+ * A Config is a struct with:
+ *   thread_type, context_type   the hot and cold parts of a thread control block. The hot part has the fields
+ *                               id, state and num_of_quantum, the cold part env and thread_func (and stack, for
+ *                               the stacks of default_hooks)
+ *   capacity                    maximal number of threads, fixes the size of every table
+ *   stack_size                  bytes of a private thread stack
+ *   policy                      where a thread that becomes READY enters the ready queue (see below)
+ *   masking                     how the scheduler keeps preemption out (see below)
+ *   hooks                       what the scheduler does around its decisions (see default_hooks)
+ *   report_errors               print the library error messages to stderr, or compile them out
+ *   tracing                     print every context switch to stderr, or compile it out
+ *
+ * The switch path itself never masks - every caller masks preemption before entering the core, and unmasks when
+ * the call returns. A thread that gets the cpu back resumes with the signal mask of the switch that resumed it,
+ * so only the first entry of a new thread restores a saved mask.
+ *
+ * The C API of uthreads.cpp is the instantiation basic_scheduler<uthreads_config>.
+ */
+
+typedef unsigned long address_t;
+
+enum thread_state {
+    UNUSED,
+    READY,
+    BLOCKED,
+    RUNNING,
+    ZOMBIE // terminated, but its resources are still in use - the id is taken until free_slot
+};
+
+/**
+ * Address translation to a given address, as glibc mangles the pointers in a jmp_buf
+ * @param addr the given address
+ * @return the translated address
+ */
+inline address_t translate_address(address_t addr)
+{
+    address_t ret;
+    asm volatile("xor    %%fs:0x30,%0\n"
+                 "rol    $0x11,%0\n"
+                 : "=g" (ret)
+                 : "0" (addr));
+    return ret;
+}
+
+/**
+ * Reverses translate_address
+ * @param addr the translated address
+ * @return the original address
+ */
+inline address_t demangle_address(address_t addr)
+{
+    address_t ret;
+    asm volatile("ror    $0x11,%0\n"
+                 "xor    %%fs:0x30,%0\n"
+                 : "=r" (ret)
+                 : "0" (addr));
+    return ret;
+}
+
+/**
+ * The READY threads, in a fixed ring - never allocates, so it is safe to use from the timer signal handler.
+ * Position 0 is the next thread to run.
+ */
+template <int Capacity>
+class ready_ring
+{
+public:
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    int size() const
+    {
+        return count;
+    }
+
+    /**
+     * @param i the position, 0 is the next thread to run
+     * @return the thread id at the given position
+     */
+    int at(int i) const
+    {
+        return slots[(head + i) % Capacity];
+    }
+
+    /**
+     * Adds a thread id behind all the others
+     */
+    void push_last(int tid)
+    {
+        slots[(head + count) % Capacity] = tid;
+        count++;
+    }
+
+    /**
+     * Adds a thread id ahead of all the others
+     */
+    void push_first(int tid)
+    {
+        head = (head + Capacity - 1) % Capacity;
+        slots[head] = tid;
+        count++;
+    }
+
+    /**
+     * Removes and returns the next thread to run
+     */
+    int pop_first()
+    {
+        int tid = slots[head];
+        head = (head + 1) % Capacity;
+        count--;
+        return tid;
+    }
+
+    /**
+     * Removes the thread id at a given position, keeping the order of the others
+     */
+    void erase_at(int i)
+    {
+        if (i == 0)
+        {
+            pop_first();
+            return;
+        }
+        for (; i < count - 1; i++)
+        {
+            slots[(head + i) % Capacity] = slots[(head + i + 1) % Capacity];
+        }
+        count--;
+    }
+
+    /**
+     * Removes a given thread id if it is in the ring
+     */
+    void erase(int tid)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            if (at(i) == tid)
+            {
+                erase_at(i);
+                return;
+            }
+        }
+    }
+
+private:
+    int slots[Capacity];
+    int head = 0;
+    int count = 0;
+};
+
+/**
+ * The sleeping threads, sorted by the quantum they wake up in - a fixed array, safe in the timer signal handler.
+ * A thread sleeps at most once, so Capacity entries always fit.
+ */
+template <int Capacity>
+class sleep_list
+{
+public:
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    int size() const
+    {
+        return count;
+    }
+
+    /**
+     * @return the wake up quantum of the first thread to wake up
+     */
+    int front() const
+    {
+        return entries[0].quantum;
+    }
+
+    /**
+     * Adds a thread that wakes up in a given quantum, behind the threads waking up in the same quantum.
+     * Replaces an earlier wake up of the same thread.
+     */
+    void insert(int quantum, int tid)
+    {
+        erase(tid);
+        int i = count;
+        for (; i > 0 && entries[i - 1].quantum > quantum; i--)
+        {
+            entries[i] = entries[i - 1];
+        }
+        entries[i] = {quantum, tid};
+        count++;
+    }
+
+    /**
+     * Removes and returns the first thread to wake up
+     */
+    int pop()
+    {
+        int tid = entries[0].tid;
+        erase_at(0);
+        return tid;
+    }
+
+    /**
+     * Removes a given thread id if it is in the list
+     */
+    void erase(int tid)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            if (entries[i].tid == tid)
+            {
+                erase_at(i);
+                return;
+            }
+        }
+    }
+
+private:
+    void erase_at(int i)
+    {
+        for (; i < count - 1; i++)
+        {
+            entries[i] = entries[i + 1];
+        }
+        count--;
+    }
+
+    struct entry
+    {
+        int quantum;
+        int tid;
+    };
+
+    entry entries[Capacity];
+    int count = 0;
+};
+
+// Threads that become READY wait behind every thread already READY - plain round robin.
+struct round_robin_policy
+{
+    template <class Queue>
+    static void make_ready(Queue &queue, int tid)
+    {
+        queue.push_last(tid);
+    }
+};
+
+// Threads that become READY run first - warmer caches for short wake ups, but no fairness guarantee.
+struct lifo_policy
+{
+    template <class Queue>
+    static void make_ready(Queue &queue, int tid)
+    {
+        queue.push_first(tid);
+    }
+};
+
+/*
+ * A masking strategy has:
+ *   static int mask(bool)       masks or unmasks preemption, 0 on success
+ *   static constexpr preemptive new threads start with every signal unmasked (false - with the mask of the switch)
+ */
+
+// For builds in which nothing preempts the threads - masking compiles to nothing.
+struct no_masking
+{
+    static constexpr bool preemptive = false;
+
+    static int mask(bool)
+    {
+        return 0;
+    }
+};
+
+// Blocks a single preemption signal with sigprocmask.
+template <int Signal>
+struct sigprocmask_masking
+{
+    static constexpr bool preemptive = true;
+
+    static int mask(bool to_mask)
+    {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, Signal);
+        return sigprocmask(to_mask ? SIG_BLOCK : SIG_UNBLOCK, &signals, nullptr);
+    }
+};
+
+/*
+ * What the scheduler does around its decisions, for a plain set of cooperative threads. A Config derives its hooks
+ * from this struct and hides the functions it needs - every hook gets the scheduler as its first argument.
+ */
+struct default_hooks
+{
+    // Before every scheduling decision, on the stack of the thread giving up the cpu.
+    template <class Scheduler>
+    static void before_decision(Scheduler &)
+    {}
+
+    // Called as long as no thread is READY at a scheduling decision. Nothing can wake a thread here - a deadlock.
+    template <class Scheduler>
+    static void idle(Scheduler &)
+    {
+        std::abort();
+    }
+
+    // A thread that has to run next whatever the queue says, NO_THREAD if none.
+    template <class Scheduler>
+    static int forced_pick(Scheduler &)
+    {
+        return NO_THREAD;
+    }
+
+    // Whether a READY thread may run now, or is passed over for the ones behind it.
+    template <class Scheduler>
+    static bool eligible(Scheduler &, int)
+    {
+        return true;
+    }
+
+    // The thread to run when no READY thread is eligible, NO_THREAD for the first one in the queue.
+    template <class Scheduler>
+    static int fallback_pick(Scheduler &)
+    {
+        return NO_THREAD;
+    }
+
+    // A thread starts a quantum of its own, not the rest of the previous one.
+    template <class Scheduler>
+    static void restart_quantum(Scheduler &)
+    {}
+
+    // After the running thread changed, before the jump to it.
+    template <class Scheduler>
+    static void dispatched(Scheduler &)
+    {}
+
+    // Gives a new thread a stack and returns its initial stack pointer. A slot keeps its stack for the next thread.
+    template <class Scheduler>
+    static address_t prepare_stack(Scheduler &scheduler, int tid)
+    {
+        auto context = &scheduler.contexts[tid];
+        if (context->stack == nullptr)
+        {
+            context->stack = new char[Scheduler::stack_size];
+        }
+        return (address_t) context->stack + Scheduler::stack_size - sizeof(address_t);
+    }
+
+    // Releases what a terminated thread owns. False if its resources are still in use - it stays a ZOMBIE.
+    template <class Scheduler>
+    static bool release_thread(Scheduler &, int)
+    {
+        return true;
+    }
+
+    // Right before the jump into a thread. May jump by itself.
+    template <class Scheduler>
+    static void before_jump(Scheduler &, int)
+    {}
+};
+
+template <class Config>
+class basic_scheduler
+{
+public:
+    typedef typename Config::thread_type thread_type;
+    typedef typename Config::context_type context_type;
+    typedef typename Config::policy policy;
+    typedef typename Config::hooks hooks;
+    static constexpr int capacity = Config::capacity;
+    static constexpr int stack_size = Config::stack_size;
+
+    alignas(CACHE_LINE_SIZE) thread_type threads[capacity]; // hot blocks, indexed by thread id
+    context_type contexts[capacity]; // cold blocks, indexed by thread id
+    ready_ring<capacity> ready;
+    sleep_list<capacity> sleepers;
+    thread_type *running = nullptr;
+    int run_next = NO_THREAD; // thread resumed by the running thread, dispatched ahead of the ready queue
+    int total_quantum = 0;
+
+    /**
+     * Makes the calling code the main thread, RUNNING in the first quantum
+     */
+    void start()
+    {
+        threads[0].id = 0;
+        threads[0].state = RUNNING;
+        threads[0].num_of_quantum = 1;
+        contexts[0].thread_func = nullptr;
+        total_quantum = 1;
+        running = &threads[0];
+    }
+
+    /**
+     * Checks if a thread with the given id exists
+     */
+    bool exists(int tid) const
+    {
+        return tid >= 0 && tid < capacity && threads[tid].state != UNUSED && threads[tid].state != ZOMBIE;
+    }
+
+    /**
+     * Checks if any thread is READY, in the ready queue or in the run next slot
+     */
+    bool has_ready() const
+    {
+        return run_next != NO_THREAD || !ready.empty();
+    }
+
+    /**
+     * Adds a thread id to the ready queue, where the policy says
+     */
+    void make_ready(int tid)
+    {
+        policy::make_ready(ready, tid);
+    }
+
+    /**
+     * Removes a thread id from the ready queue or from the run next slot
+     */
+    void remove_ready(int tid)
+    {
+        if (run_next == tid)
+        {
+            run_next = NO_THREAD;
+            return;
+        }
+        ready.erase(tid);
+    }
+
+    /**
+     * Creates a READY thread in the lowest free slot
+     * @param entry_point the thread function
+     * @return the thread id, NO_THREAD if every slot is taken
+     */
+    int spawn(void (*entry_point)())
+    {
+        int tid = 0;
+        while (tid < capacity && threads[tid].state != UNUSED)
+        {
+            tid++;
+        }
+        if (tid == capacity)
+        {
+            return NO_THREAD;
+        }
+        threads[tid].id = tid;
+        threads[tid].state = READY;
+        threads[tid].num_of_quantum = 0;
+        context_type *context = &contexts[tid];
+        context->thread_func = entry_point;
+        address_t sp = hooks::prepare_stack(*this, tid);
+        // the first jump into the thread lands on entry_point, on top of its stack
+        sigsetjmp(context->env, Config::masking::preemptive);
+        (context->env->__jmpbuf)[JB_SP] = translate_address(sp);
+        (context->env->__jmpbuf)[JB_PC] = translate_address((address_t) entry_point);
+        sigemptyset(&context->env->__saved_mask);
+        make_ready(tid);
+        return tid;
+    }
+
+    /**
+     * Gives the cpu to the next thread. The running thread stays READY unless the caller changed its state.
+     * Returns when the thread is switched to again.
+     * @param preempted true if called by the timer, false on a voluntary switch
+     */
+    void schedule(bool preempted = false)
+    {
+        if (sigsetjmp(contexts[running->id].env, 0) == 1)
+        {
+            return;
+        }
+        hooks::before_decision(*this);
+        if (preempted && run_next != NO_THREAD) // its turn is lost, but it still runs before the preempted thread
+        {
+            make_ready(run_next);
+            run_next = NO_THREAD;
+        }
+        if (running->state == RUNNING)
+        {
+            running->state = READY;
+            make_ready(running->id);
+        }
+        bool inherited;
+        int tid = pick_next(&inherited);
+        switch_to(tid, preempted, inherited);
+    }
+
+    /**
+     * Terminates the running thread and gives the cpu to the next one. Never returns.
+     */
+    [[noreturn]] void exit_running()
+    {
+        hooks::before_decision(*this);
+        bool inherited;
+        int tid = pick_next(&inherited);
+        int self = running->id;
+        threads[self].state = hooks::release_thread(*this, self) ? UNUSED : ZOMBIE; // still running on its stack
+        switch_to(tid, false, inherited);
+    }
+
+    /**
+     * Terminates a thread other than the running one
+     * @return true if the id is free again, false if the thread stays a ZOMBIE until free_slot
+     */
+    bool terminate(int tid)
+    {
+        remove_ready(tid);
+        sleepers.erase(tid);
+        threads[tid].state = hooks::release_thread(*this, tid) ? UNUSED : ZOMBIE;
+        return threads[tid].state == UNUSED;
+    }
+
+    /**
+     * Frees the id of a ZOMBIE thread once its resources are released
+     */
+    void free_slot(int tid)
+    {
+        threads[tid].state = UNUSED;
+    }
+
+    /**
+     * Blocks a given thread. Blocking the running thread makes a scheduling decision.
+     */
+    void block(int tid)
+    {
+        thread_type *cur_thread = &threads[tid];
+        if (cur_thread->state == RUNNING)
+        {
+            cur_thread->state = BLOCKED;
+            schedule();
+        }
+        else if (cur_thread->state == READY)
+        {
+            cur_thread->state = BLOCKED;
+            remove_ready(tid);
+        }
+    }
+
+    /**
+     * Resumes a blocked thread into the run next slot - it runs as soon as the running thread gives up the cpu,
+     * for the rest of the quantum. A thread resumed earlier and still in the slot goes to the ready queue.
+     */
+    void resume(int tid)
+    {
+        if (threads[tid].state != BLOCKED)
+        {
+            return;
+        }
+        threads[tid].state = READY;
+        if (run_next != NO_THREAD)
+        {
+            make_ready(run_next);
+        }
+        run_next = tid;
+    }
+
+    /**
+     * Blocks the running thread for a number of quanta, not counting the current one
+     */
+    void sleep(int num_quantums)
+    {
+        sleepers.insert(total_quantum + num_quantums + 1, running->id);
+        running->state = BLOCKED;
+        schedule();
+    }
+
+    /**
+     * Makes a blocked thread READY, through the ready queue
+     */
+    void wake(int tid)
+    {
+        if (threads[tid].state == BLOCKED)
+        {
+            threads[tid].state = READY;
+            make_ready(tid);
+        }
+    }
+
+    /**
+     * Masks or unmasks preemption
+     * @return 0 on success
+     */
+    int mask_signals(bool to_mask)
+    {
+        return Config::masking::mask(to_mask);
+    }
+
+    /**
+     * Prints a library error message, unless the configuration compiles them out
+     */
+    void report_error(const char *message)
+    {
+        if constexpr (Config::report_errors)
+        {
+            std::cerr << message << std::endl;
+        }
+    }
+
+    /**
+     * Prints a context switch, if the configuration asks for tracing
+     */
+    void trace_switch(int from, int to)
+    {
+        if constexpr (Config::tracing)
+        {
+            std::cerr << "uthreads: switch " << from << " -> " << to << std::endl;
+        }
+    }
+
+private:
+    /**
+     * Waits until a thread is READY and takes the next one to run out of the ready queue
+     * @param inherited set to true if the thread was taken from the run next slot
+     */
+    int pick_next(bool *inherited)
+    {
+        while (!has_ready())
+        {
+            hooks::idle(*this);
+        }
+        *inherited = false;
+        int tid = hooks::forced_pick(*this);
+        if (tid != NO_THREAD)
+        {
+            remove_ready(tid);
+            return tid;
+        }
+        if (run_next != NO_THREAD)
+        {
+            tid = run_next;
+            run_next = NO_THREAD;
+            if (hooks::eligible(*this, tid))
+            {
+                *inherited = true;
+                return tid;
+            }
+            make_ready(tid);
+        }
+        for (int i = 0; i < ready.size(); i++)
+        {
+            tid = ready.at(i);
+            if (hooks::eligible(*this, tid))
+            {
+                ready.erase_at(i);
+                return tid;
+            }
+        }
+        tid = hooks::fallback_pick(*this);
+        if (tid != NO_THREAD)
+        {
+            remove_ready(tid);
+            return tid;
+        }
+        return ready.pop_first();
+    }
+
+    /**
+     * Starts the next quantum in a given thread - wakes the sleepers that are due and jumps into the thread
+     * @param tid the given thread
+     * @param preempted true if the timer already started a new quantum
+     * @param inherited true if the thread runs for the rest of the current quantum
+     */
+    [[noreturn]] void switch_to(int tid, bool preempted, bool inherited)
+    {
+        if (!preempted && !inherited)
+        {
+            hooks::restart_quantum(*this);
+        }
+        total_quantum++;
+        while (!sleepers.empty() && sleepers.front() <= total_quantum) // quanta lost to timer overruns included
+        {
+            wake(sleepers.pop());
+        }
+        thread_type *next = &threads[tid];
+        next->state = RUNNING;
+        next->num_of_quantum++;
+        trace_switch(running->id, tid);
+        running = next;
+        hooks::dispatched(*this);
+        hooks::before_jump(*this, tid);
+        siglongjmp(contexts[tid].env, 1);
+    }
+};
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef _UTHREADS_EXT_H
+#define _UTHREADS_EXT_H
+
+#include <sys/types.h>
+#include "uthreads.h"
+#include "uthread_allocator.h"
+
+/*
+ * Extensions of the thread library beyond uthreads.h. The full documentation of each function is at its
+ * definition in uthreads.cpp.
+ */
+
+#define TIMER_BACKEND_ITIMER 0 // setitimer(ITIMER_VIRTUAL), microsecond resolution, user cpu time only
+#define TIMER_BACKEND_MONOTONIC 1 // timer_create(CLOCK_MONOTONIC), wall clock time
+#define TIMER_BACKEND_CPUTIME 2 // timer_create(CLOCK_PROCESS_CPUTIME_ID), user and system cpu time
+#define TIMER_BACKEND_NONE 3 // no signals at all, a host event loop drives the threads with uthread_run_once
+
+
+/**Scheduling**/
+
+/**
+ * @brief Selects the clock that drives preemption, one of TIMER_BACKEND_*. Must be called before uthread_init.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_set_timer_backend(int backend);
+
+/**
+ * @brief Gives up the cpu - the calling thread goes to the end of the READY threads list.
+ *
+ * @return 0.
+*/
+int uthread_yield();
+
+/**
+ * @brief Runs the READY threads cooperatively for up to budget_usecs micro-seconds, then returns to the host.
+ * Needs TIMER_BACKEND_NONE and must be called by the main thread.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_run_once(int budget_usecs);
+
+/**
+ * @brief Returns how long the host may block before it has to call uthread_run_once again.
+ *
+ * @return The timeout in micro-seconds, or -1 for no timeout.
+*/
+int uthread_next_deadline();
+
+
+/**Thread groups**/
+
+/**
+ * @brief Creates a thread group limited to quota_quanta quanta in every period of period_quanta quanta.
+ *
+ * @return On success, return the ID of the created group. On failure, return -1.
+*/
+int uthread_group_create(int quota_quanta, int period_quanta);
+
+/**
+ * @brief Creates a new thread in the group with ID gid, exactly like uthread_spawn.
+ *
+ * @return On success, return the ID of the created thread. On failure, return -1.
+*/
+int uthread_spawn_in_group(int gid, thread_entry_point entry_point);
+
+/**
+ * @brief Returns the number of quanta the threads of the group with ID gid started since it was created.
+ *
+ * @return On success, return the consumed quanta. On failure, return -1.
+*/
+int uthread_group_get_consumed(int gid);
+
+/**
+ * @brief Returns the number of quanta the group with ID gid spent throttled, including the current throttling.
+ *
+ * @return On success, return the throttled quanta. On failure, return -1.
+*/
+int uthread_group_get_throttled(int gid);
+
+
+/**File operations - only the calling thread waits for the disk**/
+
+/**
+ * @brief Reads up to count bytes from fd at offset into buf, like pread(2).
+ *
+ * @return On success, return the number of bytes read. On failure, return -1 and set errno.
+*/
+ssize_t uthread_pread(int fd, void *buf, size_t count, off_t offset);
+
+/**
+ * @brief Writes up to count bytes from buf to fd at offset, like pwrite(2).
+ *
+ * @return On success, return the number of bytes written. On failure, return -1 and set errno.
+*/
+ssize_t uthread_pwrite(int fd, const void *buf, size_t count, off_t offset);
+
+/**
+ * @brief Flushes the data of fd to the disk, like fsync(2).
+ *
+ * @return On success, return 0. On failure, return -1 and set errno.
+*/
+int uthread_fsync(int fd);
+
+
+/**Stacks**/
+
+/**
+ * @brief Turns on stack high water mark profiling for every thread spawned from now on.
+ *
+ * @return 0.
+*/
+int uthread_enable_stack_profiling();
+
+/**
+ * @brief Returns the highest number of stack bytes the thread with ID tid has used so far.
+ *
+ * @return On success, return the stack high water mark in bytes. On failure, return -1.
+*/
+int uthread_get_stack_usage(int tid);
+
+/**
+ * @brief Makes every spawned thread run on one shared stack. Must be called before uthread_init.
+ *
+ * @return 0.
+*/
+int uthread_enable_shared_stack();
+
+/**
+ * @brief Returns the number of bytes kept aside for the stack of the thread with ID tid in shared stack mode.
+ *
+ * @return On success, return the size in bytes. On failure, return -1.
+*/
+int uthread_get_saved_stack_size(int tid);
+
+/**
+ * @brief Returns the number of stack copies (to and from the shared stack) done since the library was initialized.
+*/
+long uthread_get_stack_copies();
+
+/**
+ * @brief Returns the total number of bytes copied to and from the shared stack since the library was initialized.
+*/
+long uthread_get_stack_copy_bytes();
+
+
+/**Observability**/
+
+/**
+ * @brief Publishes the scheduler state in a shared memory page, /dev/shm/uthreads.<pid> (see uthreads_stats.h).
+ * May be called before or after uthread_init.
+ *
+ * @return 0.
+*/
+int uthread_enable_stats_page();
+
+/**
+ * @brief Starts sampling the running thread every interval_usecs micro-seconds of process cpu time.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_profiler_start(int interval_usecs);
+
+/**
+ * @brief Stops the sampling started by uthread_profiler_start.
+ *
+ * @return 0.
+*/
+int uthread_profiler_stop();
+
+/**
+ * @brief Writes the samples to path in the collapsed stack format of flame graph tools.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_profiler_dump(const char *path);
+
+#endif
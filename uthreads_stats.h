@@ -0,0 +1,35 @@
+#ifndef _UTHREADS_STATS_H
+#define _UTHREADS_STATS_H
+
+#include "uthreads.h"
+
+/*
+ * Layout of the live statistics page the library publishes in /dev/shm once uthread_enable_stats_page is called.
+ * The scheduler rewrites the page on every scheduling decision without any system call, under a sequence lock:
+ * sequence is odd while an update is in progress, and a reader has a consistent snapshot only if it read the same
+ * even sequence before and after copying the page.
+ */
+
+#define STATS_PAGE_NAME_FORMAT "/uthreads.%d" // formatted with the pid of the process
+
+enum stats_thread_state {
+    STATS_UNUSED,
+    STATS_READY,
+    STATS_BLOCKED,
+    STATS_RUNNING
+};
+
+typedef struct{
+    unsigned sequence;
+    int max_threads;
+    int total_quantum;
+    int running_tid;
+    int ready_threads; // length of the ready queue
+    int sleeping_threads;
+    int io_waiting_threads;
+    int state_counts[STATS_RUNNING + 1]; // number of threads per stats_thread_state
+    int thread_states[MAX_THREAD_NUM]; // stats_thread_state of each thread id
+    int thread_quanta[MAX_THREAD_NUM];
+}uthreads_stats_page;
+
+#endif
@@ -0,0 +1,106 @@
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "uthreads_stats.h"
+
+/**
+ * A top like viewer of the live stats page of a process using the thread library.
+ * Usage: uthreads_top <pid> [interval_msecs]
+ */
+
+#define USAGE_ERROR "usage: uthreads_top <pid> [interval_msecs]"
+#define OPEN_ERROR "system error: failed to open the stats page, is uthread_enable_stats_page called?"
+#define DEFAULT_INTERVAL_MSECS 1000
+#define FAILURE (-1)
+#define SUCCESS 0
+
+const char *state_names[] = {"", "READY", "BLOCKED", "RUNNING"};
+
+/**
+ * Copies a consistent snapshot of the stats page, retrying while the scheduler is in the middle of an update
+ * @param page the shared page
+ * @param snapshot the copy
+ */
+void read_snapshot(const uthreads_stats_page *page, uthreads_stats_page *snapshot)
+{
+    while (true)
+    {
+        unsigned before = __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+        if (before % 2 == 1)
+        {
+            continue;
+        }
+        memcpy(snapshot, page, sizeof(uthreads_stats_page));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&page->sequence, __ATOMIC_RELAXED) == before)
+        {
+            return;
+        }
+    }
+}
+
+/**
+ * Prints a snapshot, one line per existing thread
+ * @param snapshot the given snapshot
+ * @param previous the snapshot of the previous interval, for the quanta each thread got since then
+ */
+void print_snapshot(const uthreads_stats_page *snapshot, const uthreads_stats_page *previous)
+{
+    printf("\033[H\033[J"); // clear the terminal
+    printf("total quantum %d  running %d  ready %d  sleeping %d  io %d\n",
+           snapshot->total_quantum, snapshot->running_tid, snapshot->ready_threads, snapshot->sleeping_threads,
+           snapshot->io_waiting_threads);
+    printf("threads: %d ready, %d blocked, %d running\n\n", snapshot->state_counts[STATS_READY],
+           snapshot->state_counts[STATS_BLOCKED], snapshot->state_counts[STATS_RUNNING]);
+    printf("%6s %-8s %10s %8s\n", "TID", "STATE", "QUANTA", "DELTA");
+    for (int tid = 0; tid < snapshot->max_threads && tid < MAX_THREAD_NUM; tid++)
+    {
+        int state = snapshot->thread_states[tid];
+        if (state == STATS_UNUSED)
+        {
+            continue;
+        }
+        int delta = snapshot->thread_quanta[tid] - previous->thread_quanta[tid];
+        printf("%6d %-8s %10d %8d\n", tid, state_names[state], snapshot->thread_quanta[tid], delta < 0 ? 0 : delta);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 3)
+    {
+        std::cerr << USAGE_ERROR << std::endl;
+        return FAILURE;
+    }
+    int interval_msecs = argc == 3 ? atoi(argv[2]) : DEFAULT_INTERVAL_MSECS;
+    char name[32];
+    snprintf(name, sizeof(name), STATS_PAGE_NAME_FORMAT, atoi(argv[1]));
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        std::cerr << OPEN_ERROR << std::endl;
+        return FAILURE;
+    }
+    void *page = mmap(nullptr, sizeof(uthreads_stats_page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED)
+    {
+        std::cerr << OPEN_ERROR << std::endl;
+        return FAILURE;
+    }
+
+    uthreads_stats_page snapshot{}, previous{};
+    while (true)
+    {
+        read_snapshot((const uthreads_stats_page *) page, &snapshot);
+        print_snapshot(&snapshot, &previous);
+        previous = snapshot;
+        usleep(interval_msecs * 1000);
+    }
+    return SUCCESS;
+}